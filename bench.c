@@ -0,0 +1,434 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <getopt.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "lib_tar.h"
+
+/**
+ * Benchmarks of the library on synthetic archives.
+ *
+ * The archives are generated once in the data directory (and kept, since the big ones
+ * take a while to write), then each benchmark runs its operation until it has taken
+ * BENCH_MIN_NS or BENCH_MAX_OPS operations, and prints one JSON object per line:
+ *
+ *  {"archive":"tiny","entries":1001000,"bench":"exists_miss","ops":3,"ns_per_op":...,
+ *   "headers_per_s":...,"mb_per_s":...}
+ *
+ * headers_per_s and mb_per_s are the headers parsed and the bytes read from the file,
+ * as counted by tar_stats_get(), divided by the duration. They are left out when the
+ * operation parsed no header or read no byte, as the queries answered from the entry
+ * index (built by the first of them) do. Every operation checks its answer against
+ * what the generator wrote.
+ */
+
+#define BLOCKSIZE 512
+#define PATHBUF 512
+#define BENCH_MIN_NS 500000000LL
+#define BENCH_MAX_OPS 100000
+#define MAX_ENTRIES 4096
+
+struct archive {
+    const char *name;
+    char path[PATHBUF];
+    long entries;
+    off_t size;
+
+    /* paths the benchmarks look up */
+    char last[PATHBUF];       /* last regular file of the archive */
+    char dir[PATHBUF];        /* a directory near the end of the archive */
+    long dir_entries;         /* entries list() gives for dir */
+    long dir_matches;         /* entries tar_find() matches under dir, which it does not resolve */
+    char link[PATHBUF];       /* start of a symlink chain, or a plain file */
+    int link_is_symlink;
+    size_t big;               /* size of the biggest file */
+    char big_path[PATHBUF];
+};
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* --- generator --- */
+
+struct writer {
+    FILE *f;
+    long entries;
+};
+
+static void set_octal(char *field, size_t width, unsigned long long value) {
+    snprintf(field, width, "%0*llo", (int)width - 1, value);
+}
+
+static int put_header(struct writer *w, const char *path, char type, size_t size, const char *link) {
+    tar_header_t h;
+    memset(&h, 0, sizeof(h));
+
+    size_t len = strlen(path);
+    if (len <= sizeof(h.name)) {
+        memcpy(h.name, path, len);
+    } else {
+        /* split at a slash: prefix "/" name */
+        const char *slash = path + len - sizeof(h.name) - 1;
+        while (*slash && *slash != '/') slash++;
+        if (!*slash || (size_t)(slash - path) > sizeof(h.prefix)) return -1;
+        memcpy(h.prefix, path, slash - path);
+        memcpy(h.name, slash + 1, len - (slash - path) - 1);
+    }
+
+    set_octal(h.mode, sizeof(h.mode), type == DIRTYPE ? 0755 : 0644);
+    set_octal(h.uid, sizeof(h.uid), 0);
+    set_octal(h.gid, sizeof(h.gid), 0);
+    set_octal(h.size, sizeof(h.size), size);
+    set_octal(h.mtime, sizeof(h.mtime), 1700000000);
+    h.typeflag = type;
+    if (link) memcpy(h.linkname, link, strlen(link) < sizeof(h.linkname) ? strlen(link) : sizeof(h.linkname));
+    memcpy(h.magic, TMAGIC, TMAGLEN);
+    memcpy(h.version, TVERSION, TVERSLEN);
+
+    memset(h.chksum, ' ', sizeof(h.chksum));
+    unsigned int sum = 0;
+    for (size_t i = 0; i < sizeof(h); i++) sum += ((uint8_t *)&h)[i];
+    snprintf(h.chksum, sizeof(h.chksum), "%06o", sum);
+
+    w->entries++;
+    return fwrite(&h, sizeof(h), 1, w->f) == 1 ? 0 : -1;
+}
+
+static int put_data(struct writer *w, size_t size, uint8_t fill) {
+    static uint8_t buf[1 << 20];
+    static const uint8_t zero[BLOCKSIZE];
+
+    memset(buf, fill, sizeof(buf));
+    for (size_t done = 0; done < size;) {
+        size_t n = size - done < sizeof(buf) ? size - done : sizeof(buf);
+        if (fwrite(buf, 1, n, w->f) != n) return -1;
+        done += n;
+    }
+    size_t padding = (BLOCKSIZE - size % BLOCKSIZE) % BLOCKSIZE;
+    return fwrite(zero, 1, padding, w->f) == padding ? 0 : -1;
+}
+
+static int put_file(struct writer *w, const char *path, size_t size) {
+    if (put_header(w, path, REGTYPE, size, NULL) == -1) return -1;
+    return put_data(w, size, (uint8_t)('a' + size % 26));
+}
+
+static int put_dir(struct writer *w, const char *path) {
+    return put_header(w, path, DIRTYPE, 0, NULL);
+}
+
+/* tiny: n files of 0 to 64 bytes, a thousand per directory */
+static int gen_tiny(struct writer *w, struct archive *a, long n) {
+    char path[PATHBUF];
+    for (long i = 0; i < n; i++) {
+        if (i % 1000 == 0) {
+            snprintf(path, sizeof(path), "tiny/d%06ld/", i / 1000);
+            if (put_dir(w, path) == -1) return -1;
+            strcpy(a->dir, path);
+        }
+        snprintf(path, sizeof(path), "tiny/d%06ld/file_%08ld.txt", i / 1000, i);
+        if (put_file(w, path, (size_t)(i % 65)) == -1) return -1;
+        strcpy(a->last, path);
+    }
+    a->dir_entries = a->dir_matches = (n - 1) % 1000 + 1;
+    strcpy(a->link, a->last);
+    strcpy(a->big_path, a->last);
+    a->big = (size_t)((n - 1) % 65);
+    return 0;
+}
+
+/* deep: a tree of the given fanout and depth, two small files per directory */
+static int gen_deep_dir(struct writer *w, struct archive *a, char *path, int depth, int fanout) {
+    size_t len = strlen(path);
+    if (put_dir(w, path) == -1) return -1;
+    strcpy(a->dir, path);
+
+    for (int f = 0; f < 2; f++) {
+        snprintf(path + len, PATHBUF - len, "file_%d.dat", f);
+        if (put_file(w, path, 100 + 300 * f) == -1) return -1;
+        strcpy(a->last, path);
+    }
+    if (depth > 0) {
+        for (int i = 0; i < fanout; i++) {
+            snprintf(path + len, PATHBUF - len, "subdir_%d/", i);
+            if (gen_deep_dir(w, a, path, depth - 1, fanout) == -1) return -1;
+        }
+    }
+    path[len] = '\0';
+    return 0;
+}
+
+static int gen_deep(struct writer *w, struct archive *a, int depth) {
+    char path[PATHBUF] = "deep/";
+    if (gen_deep_dir(w, a, path, depth, 3) == -1) return -1;
+    a->dir_entries = a->dir_matches = 2;    /* the last directory is a leaf */
+    strcpy(a->link, a->last);
+    strcpy(a->big_path, a->last);
+    a->big = 400;
+    return 0;
+}
+
+/* huge: a few files of mib MiB each */
+static int gen_huge(struct writer *w, struct archive *a, long mib) {
+    char path[PATHBUF];
+    if (put_dir(w, "huge/") == -1) return -1;
+    strcpy(a->dir, "huge/");
+    for (int i = 0; i < 4; i++) {
+        snprintf(path, sizeof(path), "huge/blob_%d.bin", i);
+        if (put_file(w, path, (size_t)mib << 20) == -1) return -1;
+        strcpy(a->last, path);
+    }
+    a->dir_entries = a->dir_matches = 4;
+    strcpy(a->link, a->last);
+    strcpy(a->big_path, a->last);
+    a->big = (size_t)mib << 20;
+    return 0;
+}
+
+/* symlinks: chains of 16 symlinks to a file and to a directory, among filler files */
+static int gen_symlinks(struct writer *w, struct archive *a) {
+    char path[PATHBUF], target[PATHBUF];
+
+    if (put_dir(w, "links/") == -1 || put_dir(w, "links/target_dir/") == -1) return -1;
+    for (int i = 0; i < 1000; i++) {
+        snprintf(path, sizeof(path), "links/target_dir/file_%04d", i);
+        if (put_file(w, path, 200) == -1) return -1;
+    }
+    if (put_file(w, "links/target.txt", 4096) == -1) return -1;
+
+    for (int i = 15; i >= 0; i--) {
+        snprintf(path, sizeof(path), "links/file_link_%02d", i);
+        if (i == 15) snprintf(target, sizeof(target), "links/target.txt");
+        else snprintf(target, sizeof(target), "links/file_link_%02d", i + 1);
+        if (put_header(w, path, SYMTYPE, 0, target) == -1) return -1;
+
+        snprintf(path, sizeof(path), "links/dir_link_%02d", i);
+        if (i == 15) snprintf(target, sizeof(target), "links/target_dir");
+        else snprintf(target, sizeof(target), "links/dir_link_%02d", i + 1);
+        if (put_header(w, path, SYMTYPE, 0, target) == -1) return -1;
+    }
+    strcpy(a->last, "links/target.txt");
+    strcpy(a->dir, "links/dir_link_15/");
+    a->dir_entries = 1000;                  /* those of links/target_dir/ */
+    a->dir_matches = 0;
+    strcpy(a->link, "links/file_link_00");
+    a->link_is_symlink = 1;
+    strcpy(a->big_path, "links/file_link_00");
+    a->big = 4096;
+    return 0;
+}
+
+/* Generates the archive unless a previous run left it (with its description) in place. */
+static int generate(struct archive *a, const char *dir, long param,
+                    int (*gen)(struct writer *, struct archive *, long)) {
+    char meta[PATHBUF + 8];
+    snprintf(a->path, sizeof(a->path), "%s/%s_%ld.tar", dir, a->name, param);
+    snprintf(meta, sizeof(meta), "%s.meta", a->path);
+
+    struct stat st;
+    FILE *m = fopen(meta, "rb");
+    if (m) {
+        /* read aside: the description of an older bench.c does not fit ours */
+        struct archive kept;
+        int ok = fread(&kept, sizeof(kept), 1, m) == 1 && fgetc(m) == EOF
+                 && stat(a->path, &st) == 0 && st.st_size == kept.size;
+        fclose(m);
+        if (ok) {
+            kept.name = a->name;
+            *a = kept;
+            return 0;
+        }
+    }
+
+    fprintf(stderr, "generating %s\n", a->path);
+    struct writer w = { fopen(a->path, "wb"), 0 };
+    if (!w.f) return -1;
+    static const uint8_t trailer[2 * BLOCKSIZE];
+    if (gen(&w, a, param) == -1 || fwrite(trailer, sizeof(trailer), 1, w.f) != 1) {
+        fclose(w.f);
+        return -1;
+    }
+    a->size = ftello(w.f);
+    a->entries = w.entries;
+    if (fclose(w.f) != 0) return -1;
+
+    m = fopen(meta, "wb");
+    if (!m) return -1;
+    fwrite(a, sizeof(*a), 1, m);
+    return fclose(m);
+}
+
+static int gen_tiny_cb(struct writer *w, struct archive *a, long n) { return gen_tiny(w, a, n); }
+static int gen_deep_cb(struct writer *w, struct archive *a, long d) { return gen_deep(w, a, (int)d); }
+static int gen_huge_cb(struct writer *w, struct archive *a, long m) { return gen_huge(w, a, m); }
+static int gen_symlinks_cb(struct writer *w, struct archive *a, long unused) { (void)unused; return gen_symlinks(w, a); }
+
+/* --- benchmarks --- */
+
+struct ctx {
+    int fd;
+    struct archive *a;
+    char *entries[MAX_ENTRIES];
+    uint8_t *buf;
+    long added;
+};
+
+static int op_check(struct ctx *c) { return check_archive(c->fd) == c->a->entries ? 0 : -1; }
+static int op_exists_last(struct ctx *c) { return exists(c->fd, c->a->last) > 0 ? 0 : -1; }
+static int op_exists_miss(struct ctx *c) { return exists(c->fd, "no/such/entry") == 0 ? 0 : -1; }
+static int op_is_dir(struct ctx *c) { return is_dir(c->fd, c->a->dir) > 0 ? 0 : -1; }
+static int op_is_file(struct ctx *c) { return is_file(c->fd, c->a->last) > 0 ? 0 : -1; }
+static int op_is_symlink(struct ctx *c) { return (is_symlink(c->fd, c->a->link) != 0) == c->a->link_is_symlink ? 0 : -1; }
+
+static int op_list(struct ctx *c) {
+    size_t n = MAX_ENTRIES;
+    return list(c->fd, c->a->dir, c->entries, &n) == 1 && n == (size_t)c->a->dir_entries ? 0 : -1;
+}
+
+/* the generator fills a file of size bytes with 'a' + size % 26 */
+static int op_read(struct ctx *c) {
+    size_t len = c->a->big;
+    uint8_t fill = (uint8_t)('a' + c->a->big % 26);
+    if (read_file(c->fd, c->a->big_path, 0, c->buf, &len) != 0 || len != c->a->big) return -1;
+    return len == 0 || (c->buf[0] == fill && c->buf[len / 2] == fill && c->buf[len - 1] == fill) ? 0 : -1;
+}
+
+static int count_match(const char *path, void *arg) {
+    (void)path;
+    (*(long *)arg)++;
+    return 0;
+}
+
+/* the entries of the listed directory, through the path index after the first call */
+static int op_find(struct ctx *c) {
+    char pattern[PATHBUF + 2];
+    long n = 0;
+    snprintf(pattern, sizeof(pattern), "%s*", c->a->dir);
+    return tar_find(c->fd, pattern, count_match, &n) == c->a->dir_matches && n == c->a->dir_matches ? 0 : -1;
+}
+
+static int op_add_file(struct ctx *c) {
+    char name[64];
+    static uint8_t content[100];
+    snprintf(name, sizeof(name), "bench_added_%ld", c->added++);
+    return add_file(c->fd, name, content, sizeof(content)) == 0 ? 0 : -1;
+}
+
+static void run(struct ctx *c, const char *bench, int (*op)(struct ctx *), long max_ops) {
+    long ops = 0;
+    tar_stats_reset(TAR_STATS_THREAD);
+    long long start = now_ns(), elapsed;
+    do {
+        if (op(c) == -1) {
+            printf("{\"archive\":\"%s\",\"entries\":%ld,\"bench\":\"%s\",\"error\":true}\n",
+                   c->a->name, c->a->entries, bench);
+            fflush(stdout);
+            return;
+        }
+        ops++;
+        elapsed = now_ns() - start;
+    } while (elapsed < BENCH_MIN_NS && ops < max_ops);
+
+    /* the work the calls did, nested calls included */
+    tar_stats_t stats;
+    uint64_t headers = 0, bytes = 0;
+    tar_stats_get(TAR_STATS_THREAD, &stats);
+    for (int i = 0; i < TAR_OP_COUNT; i++) {
+        headers += stats.ops[i].headers;
+        bytes += stats.ops[i].bytes_read;
+    }
+
+    double secs = elapsed / 1e9;
+    printf("{\"archive\":\"%s\",\"entries\":%ld,\"bench\":\"%s\",\"ops\":%ld,\"ns_per_op\":%.0f",
+           c->a->name, c->a->entries, bench, ops, elapsed / (double)ops);
+    if (headers) printf(",\"headers_per_s\":%.0f", headers / secs);
+    if (bytes) printf(",\"mb_per_s\":%.2f", bytes / secs / (1 << 20));
+    printf("}\n");
+    fflush(stdout);
+}
+
+static int bench_archive(struct archive *a, int add_ops) {
+    struct ctx c;
+    memset(&c, 0, sizeof(c));
+    c.a = a;
+    c.fd = open(a->path, O_RDWR);
+    c.buf = malloc(a->big ? a->big : 1);
+    if (c.fd == -1 || !c.buf) {
+        perror(a->path);
+        return -1;
+    }
+    for (int i = 0; i < MAX_ENTRIES; i++) c.entries[i] = malloc(TAR_PATH_MAX);
+
+    run(&c, "check_archive", op_check, BENCH_MAX_OPS);
+    run(&c, "exists_last", op_exists_last, BENCH_MAX_OPS);
+    run(&c, "exists_miss", op_exists_miss, BENCH_MAX_OPS);
+    run(&c, "is_dir", op_is_dir, BENCH_MAX_OPS);
+    run(&c, "is_file", op_is_file, BENCH_MAX_OPS);
+    run(&c, "is_symlink", op_is_symlink, BENCH_MAX_OPS);
+    run(&c, "list", op_list, BENCH_MAX_OPS);
+    run(&c, "read_file", op_read, BENCH_MAX_OPS);
+    run(&c, "find", op_find, BENCH_MAX_OPS);
+
+    /* add_file grows the archive, which is put back as generated afterwards:
+       it ended with two zero blocks, truncating and extending zero-fills them again */
+    run(&c, "add_file", op_add_file, add_ops);
+    if (ftruncate(c.fd, a->size - 2 * BLOCKSIZE) == -1 || ftruncate(c.fd, a->size) == -1) perror(a->path);
+
+    for (int i = 0; i < MAX_ENTRIES; i++) free(c.entries[i]);
+    free(c.buf);
+    close(c.fd);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    long tiny = 1000000, depth = 8, huge_mib = 256;
+    const char *dir = "bench_data";
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:d:s:o:u")) != -1) {
+        switch (opt) {
+            case 'n': tiny = atol(optarg); break;
+            case 'd': depth = atol(optarg); break;
+            case 's': huge_mib = atol(optarg); break;
+            case 'o': dir = optarg; break;
+            case 'u':
+                if (tar_use_uring(1) == -1) fprintf(stderr, "io_uring not available, using pread()\n");
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-n tiny_files] [-d tree_depth] [-s huge_file_mib] [-o data_dir] [-u]\n", argv[0]);
+                return -1;
+        }
+    }
+    if (mkdir(dir, 0755) == -1 && access(dir, W_OK) == -1) {
+        perror(dir);
+        return -1;
+    }
+
+    struct archive archives[4];
+    memset(archives, 0, sizeof(archives));
+    archives[0].name = "tiny";
+    archives[1].name = "deep";
+    archives[2].name = "huge";
+    archives[3].name = "symlinks";
+
+    if (generate(&archives[0], dir, tiny, gen_tiny_cb) == -1
+        || generate(&archives[1], dir, depth, gen_deep_cb) == -1
+        || generate(&archives[2], dir, huge_mib, gen_huge_cb) == -1
+        || generate(&archives[3], dir, 0, gen_symlinks_cb) == -1) {
+        perror("generate");
+        return -1;
+    }
+
+    for (int i = 0; i < 4; i++) {
+        if (bench_archive(&archives[i], 20) == -1) return -1;
+    }
+    return 0;
+}
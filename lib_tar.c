@@ -7,9 +7,24 @@
 #include <stdio.h>
 #include <limits.h>
 #include <libgen.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <zlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <time.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
 
 #define BLOCKSIZE 512
 #define PATHBUF 512
+#define MAX_SYMLINK_HOPS 16
 
 static int is_zero_block(const uint8_t *b) {
     for (int i = 0; i < BLOCKSIZE; i++) {
@@ -114,499 +129,4201 @@ int is_direct_child(const char *file, const char *dir)
 }
 
 
-static int find_entry(int tar_fd, const char *path, tar_header_t *out) {
+/*
+ * Call statistics. Every public function runs between stats_begin() and
+ * stats_end(); meanwhile the code below counts into the calling thread's
+ * struct call_stats with plain increments, and stats_end() adds the result to
+ * the thread's totals and, with relaxed atomic adds, to the global ones. A call
+ * made from within another one only adds to the outer call, except from a user
+ * callback: stats_pause() sets the outer call aside while callbacks run, so that
+ * their calls count on their own and their time is left out of its latency.
+ */
+
+struct call_stats {
+    uint64_t syscalls;
+    uint64_t bytes_read;
+    uint64_t headers;
+    uint64_t bytes_skipped;
+    uint64_t symlink_hops;
+    uint64_t cache_hits;
+};
+
+static __thread struct call_stats call;
+static __thread int call_depth;
+static __thread int call_op;
+static __thread int64_t call_start;           /* 0 when the latency is not recorded */
+static __thread tar_stats_t thread_stats;
+static tar_stats_t global_stats;
+static atomic_int record_latency;
+
+static const char *const op_names[TAR_OP_COUNT] = {
+    "check_archive", "exists", "is_dir", "is_file", "is_symlink",
+    "list", "read_file", "add_file", "tar_recover", "tar_append", "tar_find",
+    "tar_multi_open", "tar_multi_exists", "tar_multi_is_dir", "tar_multi_is_file",
+    "tar_multi_is_symlink", "tar_multi_list", "tar_multi_read_file", "tar_diff",
+    "tar_checksum_write", "tar_checksum_verify"
+};
+
+static int64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void stats_begin(int op) {
+    if (call_depth++) return;
+    call_op = op;
+    memset(&call, 0, sizeof(call));
+    call_start = atomic_load_explicit(&record_latency, memory_order_relaxed) ? now_ns() : 0;
+}
+
+struct stats_paused {
+    struct call_stats call;
+    int depth;
+    int op;
+    int64_t at;                       /* when the call was paused, 0 if not timed */
+};
+
+static void stats_pause(struct stats_paused *p) {
+    p->call = call;
+    p->depth = call_depth;
+    p->op = call_op;
+    p->at = call_start ? now_ns() : 0;
+    call_depth = 0;
+}
+
+static void stats_resume(const struct stats_paused *p) {
+    call = p->call;
+    call_depth = p->depth;
+    call_op = p->op;
+    if (p->at) call_start += now_ns() - p->at;
+}
+
+static void stat_add(uint64_t *thread_counter, uint64_t *global_counter, uint64_t n) {
+    if (!n) return;
+    *thread_counter += n;
+    __atomic_fetch_add(global_counter, n, __ATOMIC_RELAXED);
+}
+
+static void call_add(struct call_stats *to, const struct call_stats *from) {
+    to->syscalls += from->syscalls;
+    to->bytes_read += from->bytes_read;
+    to->headers += from->headers;
+    to->bytes_skipped += from->bytes_skipped;
+    to->symlink_hops += from->symlink_hops;
+    to->cache_hits += from->cache_hits;
+}
+
+static void stats_end(void) {
+    if (--call_depth) return;
+    tar_op_stats_t *t = &thread_stats.ops[call_op];
+    tar_op_stats_t *g = &global_stats.ops[call_op];
+
+    stat_add(&t->calls, &g->calls, 1);
+    stat_add(&t->syscalls, &g->syscalls, call.syscalls);
+    stat_add(&t->bytes_read, &g->bytes_read, call.bytes_read);
+    stat_add(&t->headers, &g->headers, call.headers);
+    stat_add(&t->bytes_skipped, &g->bytes_skipped, call.bytes_skipped);
+    stat_add(&t->symlink_hops, &g->symlink_hops, call.symlink_hops);
+    stat_add(&t->cache_hits, &g->cache_hits, call.cache_hits);
+
+    if (call_start) {
+        uint64_t ns = (uint64_t)(now_ns() - call_start);
+        uint64_t us = ns / 1000;
+        int bucket = us ? 64 - __builtin_clzll(us) : 0;
+        if (bucket >= TAR_LATENCY_BUCKETS) bucket = TAR_LATENCY_BUCKETS - 1;
+        stat_add(&t->latency_ns, &g->latency_ns, ns);
+        stat_add(&t->latency[bucket], &g->latency[bucket], 1);
+    }
+}
+
+
+/*
+ * Archive sources.
+ *
+ * Every function reads the archive through a tar_src: a plain tar is read with
+ * pread(), a gzip-compressed tar (.tar.gz) is inflated on the fly with zlib.
+ * For compressed archives we keep, per archive, the live inflate stream plus a
+ * list of checkpoints (zran-style snapshots of the decompressor taken every
+ * TAR_GZ_SPAN bytes of output). A read at offset X then only inflates from the
+ * closest checkpoint before X instead of from the start of the file, so the
+ * second scan of an archive jumps over large entries.
+ *
+ * The bytes of the file itself are read with pread(), or, once enabled with
+ * tar_use_uring(), through a per-thread io_uring: the reads of a header scan
+ * are served from a read-ahead window of URING_DEPTH chunks kept in flight,
+ * large reads (file data) are split in chunks submitted together. Any other
+ * read is a single pread(), as is every read once the ring is unavailable or
+ * its window already used by the scan of another source.
+ */
+
+#define URING_DEPTH 16                /* reads kept in flight */
+#define URING_CHUNK (128 * 1024)      /* bytes per read */
+
+struct uring_req {
+    int done;
+    int res;                          /* cqe result: bytes read or -errno */
+};
+
+struct ra_chunk {
+    struct uring_req req;
+    off_t off;
+    int inflight;
+    uint8_t *buf;
+};
+
+struct uring {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_sz, cq_ring_sz, sqes_sz;
+    unsigned queued;                  /* sqes written but not submitted yet */
+
+    /* read-ahead window, used by one source at a time */
+    const struct tar_src *owner;
+    int ra_fd;
+    off_t ra_head;                    /* offset of the oldest chunk */
+    struct ra_chunk ra[URING_DEPTH];
+    uint8_t *pool;
+
+    struct uring_req direct[URING_DEPTH];  /* reads of uring_read_direct() */
+    int broken;                       /* reads may still be in flight: not used again */
+};
+
+struct tar_src {
+    int fd;
+    struct gz_state *gz;              /* NULL for an uncompressed archive */
+    int uring;                        /* tar_use_uring() was on when it was opened */
+    struct uring *ring;               /* read-ahead window, claimed by a scan (src_scan()) */
+    off_t ahead;                      /* end of the range hinted ahead of a scan, see src_ahead() */
+    off_t limit;                      /* end of the snapshot read, see end_snapshot() */
+};
+
+static atomic_int use_uring;
+static __thread struct uring *thread_ring;
+static __thread int thread_ring_failed;
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p) {
+    call.syscalls++;
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    call.syscalls++;
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static void uring_free(void *arg) {
+    struct uring *u = arg;
+    if (u->sqes && u->sqes != MAP_FAILED) munmap(u->sqes, u->sqes_sz);
+    if (u->cq_ring && u->cq_ring != MAP_FAILED && u->cq_ring != u->sq_ring) munmap(u->cq_ring, u->cq_ring_sz);
+    if (u->sq_ring && u->sq_ring != MAP_FAILED) munmap(u->sq_ring, u->sq_ring_sz);
+    if (u->fd >= 0) close(u->fd);
+    free(u->pool);
+    free(u);
+}
+
+static void ring_key_create(void) {
+    pthread_key_create(&ring_key, uring_free);
+}
+
+static struct uring *uring_new(void) {
+    struct uring *u = calloc(1, sizeof(*u));
+    if (!u) return NULL;
+
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    u->fd = sys_io_uring_setup(2 * URING_DEPTH, &p);
+    if (u->fd < 0) goto fail;
+
+    u->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_ring_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (u->cq_ring_sz > u->sq_ring_sz) u->sq_ring_sz = u->cq_ring_sz;
+        u->cq_ring_sz = u->sq_ring_sz;
+    }
+    u->sq_ring = mmap(NULL, u->sq_ring_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      u->fd, IORING_OFF_SQ_RING);
+    if (u->sq_ring == MAP_FAILED) goto fail;
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        u->cq_ring = u->sq_ring;
+    } else {
+        u->cq_ring = mmap(NULL, u->cq_ring_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          u->fd, IORING_OFF_CQ_RING);
+        if (u->cq_ring == MAP_FAILED) goto fail;
+    }
+    u->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) goto fail;
+
+    uint8_t *sq = u->sq_ring, *cq = u->cq_ring;
+    u->sq_head = (unsigned *)(sq + p.sq_off.head);
+    u->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    u->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    u->sq_array = (unsigned *)(sq + p.sq_off.array);
+    u->cq_head = (unsigned *)(cq + p.cq_off.head);
+    u->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    u->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    u->pool = malloc((size_t)URING_DEPTH * URING_CHUNK);
+    if (!u->pool) goto fail;
+    for (int i = 0; i < URING_DEPTH; i++) u->ra[i].buf = u->pool + (size_t)i * URING_CHUNK;
+    return u;
+
+fail:
+    uring_free(u);
+    return NULL;
+}
+
+/* Returns the ring of the calling thread, creating it on first use. */
+static struct uring *uring_get(void) {
+    if (thread_ring || thread_ring_failed) return thread_ring;
+    pthread_once(&ring_key_once, ring_key_create);
+    thread_ring = uring_new();
+    if (!thread_ring) thread_ring_failed = 1;
+    else pthread_setspecific(ring_key, thread_ring);
+    return thread_ring;
+}
+
+/* Queues a read completing into req, submitting the queue when it is full. */
+static int uring_queue_read(struct uring *u, struct uring_req *req, int fd, void *buf, size_t len, off_t off) {
+    unsigned tail = *u->sq_tail;
+    if (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) > *u->sq_mask) {
+        if (sys_io_uring_enter(u->fd, u->queued, 0, 0) < 0) return -1;
+        u->queued = 0;
+        if (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) > *u->sq_mask) return -1;
+    }
+
+    unsigned idx = tail & *u->sq_mask;
+    struct io_uring_sqe *sqe = &u->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = (uint32_t)len;
+    sqe->off = (uint64_t)off;
+    sqe->user_data = (uint64_t)(uintptr_t)req;
+    u->sq_array[idx] = idx;
+
+    req->done = 0;
+    __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    u->queued++;
+    return 0;
+}
+
+/* Submits what is queued and marks completed requests as done. */
+static int uring_reap(struct uring *u, int wait) {
+    if (u->queued || wait) {
+        int r = sys_io_uring_enter(u->fd, u->queued, wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0);
+        /* EAGAIN/EBUSY: no room for completions yet, reaping the queue below makes some */
+        if (r < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) return -1;
+        if (r >= 0) u->queued -= (unsigned)r < u->queued ? (unsigned)r : u->queued;
+    }
+
+    unsigned head = *u->cq_head;
+    unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+        struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+        struct uring_req *req = (struct uring_req *)(uintptr_t)cqe->user_data;
+        req->res = cqe->res;
+        req->done = 1;
+        head++;
+    }
+    __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static int uring_wait(struct uring *u, struct uring_req *req) {
+    if (uring_reap(u, 0) == -1) return -1;
+    while (!req->done) {
+        if (uring_reap(u, 1) == -1) return -1;
+    }
+    return 0;
+}
+
+static int ra_submit(struct uring *u, struct ra_chunk *c, off_t off) {
+    c->off = off;
+    c->inflight = 1;
+    if (uring_queue_read(u, &c->req, u->ra_fd, c->buf, URING_CHUNK, off) == -1) {
+        c->inflight = 0;
+        c->req.done = 1;
+        c->req.res = -EIO;
+        return -1;
+    }
+    return 0;
+}
+
+static int ra_drain(struct uring *u) {
+    int ret = 0;
+    for (int i = 0; i < URING_DEPTH; i++) {
+        struct ra_chunk *c = &u->ra[i];
+        if (c->inflight && uring_wait(u, &c->req) == -1) {
+            u->broken = 1;
+            ret = -1;
+        }
+        c->inflight = 0;
+    }
+    return ret;
+}
+
+/* Moves the window so that it starts with the chunk holding off. */
+static int ra_restart(struct uring *u, off_t off) {
+    if (ra_drain(u) == -1) return -1;
+    u->ra_head = off - off % URING_CHUNK;
+    for (int i = 0; i < URING_DEPTH; i++) {
+        off_t o = u->ra_head + (off_t)i * URING_CHUNK;
+        if (ra_submit(u, &u->ra[(o / URING_CHUNK) % URING_DEPTH], o) == -1) return -1;
+    }
+    return uring_reap(u, 0);
+}
+
+/* Reads through the read-ahead window. Returns like pread(). */
+static ssize_t ra_read(struct uring *u, void *buf, size_t len, off_t off) {
+    const off_t span = (off_t)URING_DEPTH * URING_CHUNK;
+    size_t done = 0;
+
+    while (done < len) {
+        off_t o = off + (off_t)done;
+        if (o < u->ra_head || o >= u->ra_head + span) {
+            if (ra_restart(u, o) == -1) return -1;
+        }
+
+        /* recycle the chunks we are done with for the data after the window */
+        while (u->ra_head + URING_CHUNK <= o) {
+            struct ra_chunk *c = &u->ra[(u->ra_head / URING_CHUNK) % URING_DEPTH];
+            if (c->inflight && uring_wait(u, &c->req) == -1) return -1;
+            c->inflight = 0;
+            if (ra_submit(u, c, u->ra_head + span) == -1) return -1;
+            u->ra_head += URING_CHUNK;
+        }
+
+        struct ra_chunk *c = &u->ra[(o / URING_CHUNK) % URING_DEPTH];
+        if (uring_wait(u, &c->req) == -1) return -1;
+        if (c->req.res < 0) return -1;
+
+        off_t avail = (off_t)c->req.res - (o - c->off);
+        if (avail <= 0) {
+            /* end of file, or a short read: pread() tells which */
+            call.syscalls++;
+            ssize_t r = pread(u->ra_fd, (uint8_t *)buf + done, len - done, o);
+            if (r < 0) return -1;
+            return (ssize_t)(done + (size_t)r);
+        }
+        size_t n = (size_t)avail < len - done ? (size_t)avail : len - done;
+        memcpy((uint8_t *)buf + done, c->buf + (o - c->off), n);
+        done += n;
+    }
+    return (ssize_t)done;
+}
+
+/* Waits for the count requests from reqs[head] on. If a wait fails, the kernel may
+   still write into their buffers: the ring is marked broken so that nothing reuses it. */
+static int uring_settle(struct uring *u, struct uring_req *reqs, int head, int count) {
+    for (int i = 0; i < count; i++) {
+        if (uring_wait(u, &reqs[(head + i) % URING_DEPTH]) == -1) {
+            u->broken = 1;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Reads a large range straight into buf, keeping up to URING_DEPTH chunks in flight. */
+static ssize_t uring_read_direct(struct uring *u, int fd, void *buf, size_t len, off_t off) {
+    struct uring_req *reqs = u->direct;
+    size_t lens[URING_DEPTH];
+    size_t next = 0;       /* next byte to submit */
+    size_t done = 0;       /* bytes completed in order */
+    int head = 0, count = 0;
+
+    while (done < len) {
+        while (count < URING_DEPTH && next < len) {
+            int slot = (head + count) % URING_DEPTH;
+            size_t n = len - next < URING_CHUNK ? len - next : URING_CHUNK;
+            if (uring_queue_read(u, &reqs[slot], fd, (uint8_t *)buf + next, n, off + (off_t)next) == -1) break;
+            lens[slot] = n;
+            next += n;
+            count++;
+        }
+        if (count == 0) return -1;
+
+        int ok = uring_settle(u, reqs, head, 1);
+        if (ok == 0 && reqs[head].res >= 0 && (size_t)reqs[head].res == lens[head]) {
+            done += lens[head];
+            head = (head + 1) % URING_DEPTH;
+            count--;
+            continue;
+        }
+
+        /* error or short read: let everything in flight land before returning */
+        if (uring_settle(u, reqs, (head + 1) % URING_DEPTH, count - 1) == -1) return -1;
+        if (ok == -1 || reqs[head].res < 0) return -1;
+        done += (size_t)reqs[head].res;
+        call.syscalls++;
+        ssize_t r = pread(fd, (uint8_t *)buf + done, len - done, off + (off_t)done);
+        if (r < 0) return -1;
+        return (ssize_t)(done + (size_t)r);
+    }
+    return (ssize_t)done;
+}
+
+/**
+ * Selects the backend used to read archives.
+ * By default every read is a pread() issued one at a time. With io_uring, scans keep a
+ * read-ahead window of several chunks in flight and large reads are split in chunks
+ * submitted together, so the device sees a deeper queue. Falls back to pread() when a
+ * read cannot go through the ring.
+ *
+ * @param enable Non-zero to read through io_uring, zero to go back to pread().
+ *
+ * @return 0 on success,
+ *         -1 if io_uring is not available (pread() stays in use).
+ */
+int tar_use_uring(int enable) {
+    if (!enable) {
+        atomic_store(&use_uring, 0);
+        return 0;
+    }
+    if (!uring_get()) return -1;
+    atomic_store(&use_uring, 1);
+    return 0;
+}
+
+/* Reads len bytes at offset off of the file behind src, short only at its end. */
+static ssize_t raw_pread(struct tar_src *src, void *buf, size_t len, off_t off) {
+    size_t done = 0;
+    int bulk = len >= 2 * URING_CHUNK;
+
+    /* bulk reads go through the thread's ring, the others only while scanning */
+    struct uring *u = bulk && src->uring ? uring_get() : src->ring;
+    if (u && !u->broken) {
+        ssize_t r = bulk ? uring_read_direct(u, src->fd, buf, len, off) : ra_read(u, buf, len, off);
+        if (r > 0) call.bytes_read += (uint64_t)r;
+        return r;
+    }
+
+    while (done < len) {
+        call.syscalls++;
+        ssize_t r = pread(src->fd, (uint8_t *)buf + done, len - done, off + (off_t)done);
+        if (r < 0) return -1;
+        if (r == 0) break;
+        done += (size_t)r;
+    }
+    call.bytes_read += done;
+    return (ssize_t)done;
+}
+
+
+#ifndef TAR_GZ_SPAN
+#define TAR_GZ_SPAN (1L << 20)        /* uncompressed bytes between two checkpoints */
+#endif
+#define GZ_WINSIZE 32768              /* deflate history window */
+#define GZ_CHUNK 16384                /* compressed bytes read at once */
+#define GZ_CACHE_MAX 8                /* compressed archives whose state we keep */
+
+#if TAR_GZ_SPAN < GZ_WINSIZE
+#error "TAR_GZ_SPAN must be at least the deflate window size"
+#endif
+
+struct gz_point {
+    off_t out;                   /* uncompressed offset of the checkpoint */
+    off_t in;                    /* compressed offset of the first complete byte */
+    int bits;                    /* bits of the byte before `in` still to be used (0-7) */
+    uint8_t window[GZ_WINSIZE];  /* the output preceding the checkpoint */
+};
+
+struct gz_state {
+    /* identity of the archive, a state is dropped when the file changes */
+    dev_t dev;
+    ino_t ino;
+    off_t fsize;
+    struct timespec mtime;
+    int refs;
+    int cached;
+    pthread_mutex_t lock;
+
+    z_stream strm;
+    int live;                    /* strm holds a usable stream */
+    int raw;                     /* strm was restarted from a checkpoint (raw deflate) */
+    int eof;                     /* end of the compressed data reached */
+    off_t in;                    /* compressed offset of the next byte to read */
+    off_t out;                   /* uncompressed offset reached by strm */
+    uint8_t inbuf[GZ_CHUNK];
+    uint8_t window[GZ_WINSIZE];  /* circular, byte at offset o is at o % GZ_WINSIZE */
+
+    struct gz_point **pts;       /* sorted by out */
+    size_t npts;
+    size_t cap;
+};
+
+
+static pthread_mutex_t gz_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct gz_state *gz_cache[GZ_CACHE_MAX];
+
+static void gz_free(struct gz_state *g) {
+    if (g->live) inflateEnd(&g->strm);
+    for (size_t i = 0; i < g->npts; i++) free(g->pts[i]);
+    free(g->pts);
+    pthread_mutex_destroy(&g->lock);
+    free(g);
+}
+
+/* Moves what is left of the input to the start of inbuf and reads more after it.
+   Returns the number of bytes read, 0 at the end of the file, -1 on error. */
+static int gz_fill(struct gz_state *g, struct tar_src *src) {
+    size_t keep = g->strm.avail_in;
+    if (keep && g->strm.next_in != g->inbuf) memmove(g->inbuf, g->strm.next_in, keep);
+
+    ssize_t r = raw_pread(src, g->inbuf + keep, GZ_CHUNK - keep, g->in);
+    if (r < 0) return -1;
+
+    g->in += r;
+    g->strm.next_in = g->inbuf;
+    g->strm.avail_in = (uInt)(keep + r);
+    return (int)r;
+}
+
+/* Restarts the stream at checkpoint p, or at the start of the file if p is NULL. */
+static int gz_reset(struct gz_state *g, struct tar_src *src, const struct gz_point *p) {
+    if (g->live) inflateEnd(&g->strm);
+    g->live = 0;
+    memset(&g->strm, 0, sizeof(g->strm));
+    if (inflateInit2(&g->strm, p ? -15 : 31) != Z_OK) return -1;
+    g->live = 1;
+    g->eof = 0;
+    g->strm.next_in = g->inbuf;
+    g->strm.avail_in = 0;
+
+    if (!p) {
+        g->in = 0;
+        g->out = 0;
+        g->raw = 0;
+        memset(g->window, 0, sizeof(g->window));
+        return 0;
+    }
+
+    g->in = p->in - (p->bits ? 1 : 0);
+    g->raw = 1;
+    if (p->bits) {
+        if (gz_fill(g, src) <= 0) return -1;
+        int c = g->strm.next_in[0];
+        g->strm.next_in++;
+        g->strm.avail_in--;
+        if (inflatePrime(&g->strm, p->bits, c >> (8 - p->bits)) != Z_OK) return -1;
+    }
+    if (inflateSetDictionary(&g->strm, p->window, GZ_WINSIZE) != Z_OK) return -1;
+
+    /* lay the saved history out in the circular window */
+    size_t w = (size_t)(p->out % GZ_WINSIZE);
+    memcpy(g->window + w, p->window, GZ_WINSIZE - w);
+    memcpy(g->window, p->window + GZ_WINSIZE - w, w);
+    g->out = p->out;
+    return 0;
+}
+
+static int gz_add_point(struct gz_state *g) {
+    if (g->npts == g->cap) {
+        size_t cap = g->cap ? 2 * g->cap : 16;
+        struct gz_point **pts = realloc(g->pts, cap * sizeof(*pts));
+        if (!pts) return -1;
+        g->pts = pts;
+        g->cap = cap;
+    }
+
+    struct gz_point *p = malloc(sizeof(*p));
+    if (!p) return -1;
+    p->out = g->out;
+    p->in = g->in - g->strm.avail_in;
+    p->bits = g->strm.data_type & 7;
+
+    size_t w = (size_t)(g->out % GZ_WINSIZE);
+    memcpy(p->window, g->window + w, GZ_WINSIZE - w);
+    memcpy(p->window + GZ_WINSIZE - w, g->window, w);
+
+    g->pts[g->npts++] = p;
+    return 0;
+}
+
+/* End of a gzip member: skips its trailer if we were inflating raw deflate
+   (gzip mode consumes it itself), then starts on the next member if any. */
+static int gz_next_member(struct gz_state *g, struct tar_src *src) {
+    size_t trailer = g->raw ? 8 : 0;
+
+    while (g->strm.avail_in < trailer + 2) {
+        int r = gz_fill(g, src);
+        if (r < 0) return -1;
+        if (r == 0) break;
+    }
+    if (g->strm.avail_in < trailer) return -1;
+    g->strm.next_in += trailer;
+    g->strm.avail_in -= trailer;
+
+    if (g->strm.avail_in < 2 || g->strm.next_in[0] != 0x1f || g->strm.next_in[1] != 0x8b) {
+        g->eof = 1;
+        return 0;
+    }
+    if (inflateReset2(&g->strm, 31) != Z_OK) return -1;
+    g->raw = 0;
+    return 0;
+}
+
+/* Inflates the next piece of output into the window, taking a checkpoint at
+   block boundaries every TAR_GZ_SPAN bytes.
+   Returns the number of bytes produced, 0 at the end of the data, -1 on error. */
+static ssize_t gz_step(struct gz_state *g, struct tar_src *src) {
+    size_t w = (size_t)(g->out % GZ_WINSIZE);
+    size_t room = GZ_WINSIZE - w;
+    g->strm.next_out = g->window + w;
+    g->strm.avail_out = (uInt)room;
+
+    while (!g->eof && g->strm.avail_out == room) {
+        if (g->strm.avail_in == 0 && gz_fill(g, src) <= 0) return -1; /* error or truncated */
+
+        uInt before = g->strm.avail_out;
+        int ret = inflate(&g->strm, Z_BLOCK);
+        if (ret != Z_OK && ret != Z_STREAM_END) return -1;
+        g->out += before - g->strm.avail_out;
+
+        if (ret == Z_STREAM_END) {
+            if (gz_next_member(g, src) == -1) return -1;
+        } else if ((g->strm.data_type & 128) && !(g->strm.data_type & 64)) {
+            off_t last = g->npts ? g->pts[g->npts - 1]->out : 0;
+            if (g->out - last >= TAR_GZ_SPAN && gz_add_point(g) == -1) return -1;
+        }
+    }
+    return (ssize_t)(room - g->strm.avail_out);
+}
+
+static ssize_t gz_pread(struct gz_state *g, struct tar_src *src, void *buf, size_t len, off_t off) {
+    pthread_mutex_lock(&g->lock);
+
+    /* closest checkpoint at or before off */
+    size_t lo = 0, hi = g->npts;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (g->pts[mid]->out <= off) lo = mid + 1;
+        else hi = mid;
+    }
+    const struct gz_point *p = lo ? g->pts[lo - 1] : NULL;
+
+    /* keep the live stream if off is still in its window or ahead of it and
+       no checkpoint lies in between */
+    if (!g->live || off < g->out - GZ_WINSIZE || (p && p->out > g->out)) {
+        if (gz_reset(g, src, p) == -1) goto fail;
+    }
+
+    size_t done = 0;
+    while (done < len) {
+        off_t want = off + (off_t)done;
+        if (want < g->out) {
+            size_t w = (size_t)(want % GZ_WINSIZE);
+            size_t n = (size_t)(g->out - want);
+            if (n > GZ_WINSIZE - w) n = GZ_WINSIZE - w;
+            if (n > len - done) n = len - done;
+            memcpy((uint8_t *)buf + done, g->window + w, n);
+            done += n;
+            continue;
+        }
+        ssize_t r = gz_step(g, src);
+        if (r < 0) goto fail;
+        if (r == 0) break;
+    }
+
+    pthread_mutex_unlock(&g->lock);
+    return (ssize_t)done;
+
+fail:
+    if (g->live) inflateEnd(&g->strm);
+    g->live = 0;
+    pthread_mutex_unlock(&g->lock);
+    return -1;
+}
+
+/* Returns the (referenced) state of the compressed archive behind fd. */
+static struct gz_state *gz_get(int fd) {
+    struct stat st;
+    call.syscalls++;
+    if (fstat(fd, &st) == -1) return NULL;
+
+    pthread_mutex_lock(&gz_cache_lock);
+    int slot = -1;
+    for (int i = 0; i < GZ_CACHE_MAX; i++) {
+        struct gz_state *g = gz_cache[i];
+        if (!g) {
+            if (slot == -1) slot = i;
+            continue;
+        }
+        if (g->dev == st.st_dev && g->ino == st.st_ino) {
+            if (g->fsize == st.st_size && g->mtime.tv_sec == st.st_mtim.tv_sec
+                && g->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+                g->refs++;
+                pthread_mutex_unlock(&gz_cache_lock);
+                return g;
+            }
+            /* the file changed, its checkpoints are worthless */
+            gz_cache[i] = NULL;
+            g->cached = 0;
+            if (g->refs == 0) gz_free(g);
+            if (slot == -1) slot = i;
+        }
+    }
+    if (slot == -1) {
+        for (int i = 0; i < GZ_CACHE_MAX; i++) {
+            if (gz_cache[i]->refs == 0) {
+                gz_free(gz_cache[i]);
+                gz_cache[i] = NULL;
+                slot = i;
+                break;
+            }
+        }
+    }
+
+    struct gz_state *g = calloc(1, sizeof(*g));
+    if (g) {
+        g->dev = st.st_dev;
+        g->ino = st.st_ino;
+        g->fsize = st.st_size;
+        g->mtime = st.st_mtim;
+        g->refs = 1;
+        pthread_mutex_init(&g->lock, NULL);
+        if (slot != -1) {
+            g->cached = 1;
+            gz_cache[slot] = g;
+        }
+    }
+    pthread_mutex_unlock(&gz_cache_lock);
+    return g;
+}
+
+static void gz_put(struct gz_state *g) {
+    pthread_mutex_lock(&gz_cache_lock);
+    if (--g->refs == 0 && !g->cached) gz_free(g);
+    pthread_mutex_unlock(&gz_cache_lock);
+}
+
+/*
+ * Snapshots. An appender (see tar_appender_open()) publishes the committed end of
+ * its archive in a slot here after each commit. A reader looks the archive up when
+ * it starts and reads it as if it ended there: whatever lies past that offset
+ * (an append in progress, the old trailer being overwritten) reads as zeros, i.e.
+ * as the end of the archive. Slots are seqlocks, so readers never block the
+ * appender nor each other, and take no lock at all while no appender is open.
+ */
+
+#define END_SLOTS 64
+
+struct end_slot {
+    atomic_uint seq;                  /* odd while the slot is being written */
+    _Atomic uint64_t dev;
+    _Atomic uint64_t ino;             /* 0 for a free slot */
+    _Atomic int64_t end;
+    int claimed;                      /* under end_slots_lock */
+};
+
+static struct end_slot end_slots[END_SLOTS];
+static atomic_int end_slots_claimed;
+static pthread_mutex_t end_slots_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Writes a slot. Writers of a slot are serialised by its owner. */
+static void end_publish(struct end_slot *slot, uint64_t dev, uint64_t ino, off_t end) {
+    unsigned int seq = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+    atomic_store_explicit(&slot->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&slot->dev, dev, memory_order_relaxed);
+    atomic_store_explicit(&slot->ino, ino, memory_order_relaxed);
+    atomic_store_explicit(&slot->end, (int64_t)end, memory_order_relaxed);
+    atomic_store_explicit(&slot->seq, seq + 2, memory_order_release);
+}
+
+static struct end_slot *end_claim(uint64_t dev, uint64_t ino, off_t end) {
+    struct end_slot *slot = NULL;
+    pthread_mutex_lock(&end_slots_lock);
+    for (int i = 0; i < END_SLOTS; i++) {
+        if (!end_slots[i].claimed) {
+            if (!slot) slot = &end_slots[i];
+        } else if (atomic_load(&end_slots[i].dev) == dev && atomic_load(&end_slots[i].ino) == ino) {
+            slot = NULL;    /* one appender per archive */
+            break;
+        }
+    }
+    if (slot) {
+        slot->claimed = 1;
+        end_publish(slot, dev, ino, end);
+        atomic_fetch_add(&end_slots_claimed, 1);
+    }
+    pthread_mutex_unlock(&end_slots_lock);
+    return slot;
+}
+
+static void end_release(struct end_slot *slot) {
+    pthread_mutex_lock(&end_slots_lock);
+    end_publish(slot, 0, 0, 0);
+    slot->claimed = 0;
+    atomic_fetch_sub(&end_slots_claimed, 1);
+    pthread_mutex_unlock(&end_slots_lock);
+}
+
+/* Committed end of the archive st describes if an appender publishes it, else -1. */
+static off_t end_lookup(const struct stat *st) {
+    if (atomic_load(&end_slots_claimed) == 0) return -1;
+    for (int i = 0; i < END_SLOTS; i++) {
+        struct end_slot *slot = &end_slots[i];
+        unsigned int s1, s2;
+        uint64_t dev, ino;
+        int64_t end;
+        do {
+            s1 = atomic_load_explicit(&slot->seq, memory_order_acquire);
+            dev = atomic_load_explicit(&slot->dev, memory_order_relaxed);
+            ino = atomic_load_explicit(&slot->ino, memory_order_relaxed);
+            end = atomic_load_explicit(&slot->end, memory_order_relaxed);
+            atomic_thread_fence(memory_order_acquire);
+            s2 = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+        } while ((s1 & 1) || s1 != s2);
+
+        if (ino != 0 && dev == (uint64_t)st->st_dev && ino == (uint64_t)st->st_ino) return (off_t)end;
+    }
+    return -1;
+}
+
+/* Committed end of the archive behind fd if an appender publishes it, else -1. */
+static off_t end_snapshot(int fd) {
+    struct stat st;
+    if (atomic_load(&end_slots_claimed) == 0) return -1;
+    call.syscalls++;
+    if (fstat(fd, &st) == -1) return -1;
+    return end_lookup(&st);
+}
+
+static void src_init(struct tar_src *src, int tar_fd, off_t limit) {
+    src->fd = tar_fd;
+    src->gz = NULL;
+    src->uring = atomic_load(&use_uring);
+    src->ring = NULL;
+    src->ahead = 0;
+    src->limit = limit == -1 ? INT64_MAX : limit;
+}
+
+static int src_open(struct tar_src *src, int tar_fd) {
+    uint8_t magic[2];
+    src_init(src, tar_fd, end_snapshot(tar_fd));
+
+    call.syscalls++;
+    ssize_t r = pread(tar_fd, magic, sizeof(magic), 0);
+    if (r < 0) return -1;
+    call.bytes_read += (uint64_t)r;
+    if (r == 2 && magic[0] == 0x1f && magic[1] == 0x8b) {
+        src->gz = gz_get(tar_fd);
+        if (!src->gz) return -1;
+    }
+    return 0;
+}
+
+/* src_open() for an archive whose snapshot (end_lookup()) and compression are
+   already known, without the system calls that find them out. */
+static int src_open_known(struct tar_src *src, int tar_fd, off_t limit, int gz) {
+    src_init(src, tar_fd, limit);
+    if (gz && !(src->gz = gz_get(tar_fd))) return -1;
+    return 0;
+}
+
+static void src_close(struct tar_src *src) {
+    if (src->gz) gz_put(src->gz);
+    src->gz = NULL;
+    if (src->ring) {
+        ra_drain(src->ring);
+        src->ring->owner = NULL;
+        src->ring = NULL;
+    }
+}
+
+/*
+ * Page cache hints. They are all given for a range: the access pattern advice
+ * (POSIX_FADV_SEQUENTIAL and the like) holds for the whole open file, which is
+ * the caller's and may be shared with other threads, so we leave it alone.
+ * Header scans walk the archive front to back: they ask for the SCAN_AHEAD
+ * bytes past the header they reach once they are through the previous range,
+ * so that the kernel reads those while we parse. Once a bulk read (at least
+ * TAR_DROP_BEHIND bytes) has been copied out, its pages are dropped so that
+ * extracting large entries does not evict the rest of the page cache.
+ * Range hints are skipped for compressed archives, whose offsets are not file
+ * offsets, and while a scan reads through the io_uring window, which already
+ * keeps the next chunks in flight.
+ */
+
+#ifndef TAR_DROP_BEHIND
+#define TAR_DROP_BEHIND (1L << 20)
+#endif
+#define SCAN_AHEAD (256 * 1024)
+
+static void src_scan(struct tar_src *src) {
+    if (src->uring && !src->ring) {
+        struct uring *u = uring_get();
+        if (u && !u->owner && !u->broken) {
+            u->owner = src;
+            u->ra_fd = src->fd;
+            u->ra_head = -(off_t)URING_DEPTH * URING_CHUNK;  /* empty window */
+            src->ring = u;
+        }
+    }
+}
+
+/* Called by a scan about to read the header at off. */
+static void src_ahead(struct tar_src *src, off_t off) {
+    if (src->gz || src->ring || off < src->ahead || off >= src->limit) return;
+    call.syscalls++;
+    posix_fadvise(src->fd, off, SCAN_AHEAD, POSIX_FADV_WILLNEED);
+    src->ahead = off + SCAN_AHEAD;
+}
+
+static void src_dontneed(struct tar_src *src, off_t off, size_t len) {
+    if (src->gz || len < TAR_DROP_BEHIND) return;
+    call.syscalls++;
+    posix_fadvise(src->fd, off, (off_t)len, POSIX_FADV_DONTNEED);
+}
+
+/* Reads len bytes at offset off of the (uncompressed) tar stream.
+   Returns the number of bytes read, short only at the end of the archive. */
+static ssize_t src_pread(struct tar_src *src, void *buf, size_t len, off_t off) {
+    uint64_t syscalls = call.syscalls;
+    ssize_t r;
+
+    if (src->gz) {
+        r = gz_pread(src->gz, src, buf, len, off);
+    } else if (off + (off_t)len > src->limit) {
+        /* past the snapshot, the archive is closed by zero blocks */
+        size_t keep = off < src->limit ? (size_t)(src->limit - off) : 0;
+        r = keep ? raw_pread(src, buf, keep, off) : 0;
+        if (r == (ssize_t)keep) {
+            memset((uint8_t *)buf + keep, 0, len - keep);
+            r = (ssize_t)len;
+        }
+    } else {
+        r = raw_pread(src, buf, len, off);
+    }
+
+    /* served from the read-ahead window or the inflated stream */
+    if (r >= 0 && call.syscalls == syscalls) call.cache_hits++;
+    return r;
+}
+
+
+/*
+ * Entry scan. Every function walks the archive with scan_next(), which yields
+ * one logical entry at a time: the extension headers in front of an entry
+ * (PAX 'x' records, GNU 'L'/'K' long names) are read and applied to it, so
+ * paths and link targets are not bounded by the 100/155 bytes of the ustar
+ * fields nor by PATHBUF. PAX 'g' records hold archive-wide defaults, not entry
+ * names, and are consumed without effect.
+ */
+
+#define PAX_HEADER 'x'
+#define PAX_GLOBAL 'g'
+#define GNU_LONGNAME 'L'
+#define GNU_LONGLINK 'K'
+#define GNU_MAGIC "ustar "            /* GNU tar: "ustar " then a version of " " and a null */
+#define GNU_VERSION " "
+#ifndef TAR_EXT_MAX
+#define TAR_EXT_MAX (1L << 24)        /* largest extension header we accept */
+#endif
+
+/* scan_next() errors, in sc->err */
+#define SCAN_BAD_MAGIC (-1)
+#define SCAN_BAD_VERSION (-2)
+#define SCAN_BAD_CHECKSUM (-3)
+#define SCAN_TRUNCATED (-4)           /* the file ends within an entry's headers */
+#define SCAN_MALFORMED (-5)           /* unreadable extension header, or out of memory */
+
+/* What scan_next() checks on every header, extension headers included. */
+#define SCAN_CHECKSUM 1
+#define SCAN_STRICT 2                 /* checksum, magic and version */
+
+struct tar_entry {
+    tar_header_t h;                   /* the header describing the entry */
+    char *path;                       /* full path, of any length */
+    char *link;                       /* link target, of any length */
+    size_t path_cap;
+    size_t link_cap;
+    off_t size;                       /* size of the data */
+    off_t start;                      /* offset of the entry's first header, extension headers included */
+    off_t data;                       /* offset of the data */
+};
+
+struct tar_scan {
+    struct tar_src *src;
+    int check;
+    int err;
+    off_t pos;                        /* next header, or the first zero block at the end */
+    off_t skip;                       /* data of the last entry, skipped unless it was read */
+    int headers;                      /* non-null headers read, extension headers included */
+    struct tar_entry e;
+    char *ext;                        /* extension header data */
+    size_t ext_cap;
+};
+
+static void entry_free(struct tar_entry *e) {
+    free(e->path);
+    free(e->link);
+    memset(e, 0, sizeof(*e));
+}
+
+/* Sets *str to the n bytes at s (stopping at a null) followed by a null. */
+static int str_set(char **str, size_t *cap, const char *s, size_t n) {
+    const char *nul = memchr(s, '\0', n);
+    if (nul) n = (size_t)(nul - s);
+    if (n + 1 > *cap) {
+        char *grown = realloc(*str, n + 1);
+        if (!grown) return -1;
+        *str = grown;
+        *cap = n + 1;
+    }
+    memcpy(*str, s, n);
+    (*str)[n] = '\0';
+    return 0;
+}
+
+static void scan_begin(struct tar_scan *sc, struct tar_src *src, int check) {
+    memset(sc, 0, sizeof(*sc));
+    sc->src = src;
+    sc->check = check;
+    src_scan(src);
+}
+
+static void scan_end(struct tar_scan *sc) {
+    entry_free(&sc->e);
+    free(sc->ext);
+    sc->ext = NULL;
+}
+
+static int scan_fail(struct tar_scan *sc, int err) {
+    sc->err = err;
+    return -1;
+}
+
+static int check_header(const tar_header_t *h, int check) {
+    if (check >= SCAN_STRICT) {
+        int gnu = memcmp(h->magic, GNU_MAGIC, TMAGLEN) == 0;
+        if (!gnu && (memcmp(h->magic, TMAGIC, TMAGLEN - 1) != 0 || h->magic[TMAGLEN - 1] != '\0')) {
+            return SCAN_BAD_MAGIC;
+        }
+        if (gnu ? memcmp(h->version, GNU_VERSION, TVERSLEN) != 0 : memcmp(h->version, TVERSION, TVERSLEN) != 0) {
+            return SCAN_BAD_VERSION;
+        }
+    }
+    if (check && (unsigned int)TAR_INT(h->chksum) != compute_checksum(h)) return SCAN_BAD_CHECKSUM;
+    return 0;
+}
+
+/* Applies the records "<length> <key>=<value>\n" of a PAX header to e.
+   Sets the bits of *found: 1 for a path, 2 for a link target, 4 for a size. */
+static int pax_apply(struct tar_entry *e, const char *p, size_t n, int *found) {
+    while (n > 0) {
+        char *end;
+        unsigned long len = strtoul(p, &end, 10);
+        if (end == p || *end != ' ' || len > n || len < (size_t)(end - p) + 3 || p[len - 1] != '\n') return -1;
+
+        const char *key = end + 1;
+        const char *rec_end = p + len - 1;
+        const char *eq = memchr(key, '=', (size_t)(rec_end - key));
+        if (!eq) return -1;
+        size_t klen = (size_t)(eq - key);
+        const char *val = eq + 1;
+        size_t vlen = (size_t)(rec_end - val);
+
+        if (klen == 4 && memcmp(key, "path", 4) == 0) {
+            if (str_set(&e->path, &e->path_cap, val, vlen) == -1) return -1;
+            *found |= 1;
+        } else if (klen == 8 && memcmp(key, "linkpath", 8) == 0) {
+            if (str_set(&e->link, &e->link_cap, val, vlen) == -1) return -1;
+            *found |= 2;
+        } else if (klen == 4 && memcmp(key, "size", 4) == 0) {
+            e->size = (off_t)strtoll(val, NULL, 10);
+            *found |= 4;
+        }
+        p += len;
+        n -= len;
+    }
+    return 0;
+}
+
+/* Moves sc to the next entry. Returns 1 with the entry in sc->e, 0 at the
+   first zero block (sc->pos is then its offset), -1 on error (see sc->err). */
+static int scan_next(struct tar_scan *sc) {
+    struct tar_entry *e = &sc->e;
+    int found = 0;
+
+    call.bytes_skipped += (uint64_t)sc->skip;
+    sc->skip = 0;
+    e->start = sc->pos;
+
+    while (1) {
+        src_ahead(sc->src, sc->pos);
+        if (src_pread(sc->src, &e->h, BLOCKSIZE, sc->pos) != BLOCKSIZE) return scan_fail(sc, SCAN_TRUNCATED);
+        if (is_zero_block((const uint8_t *)&e->h)) {
+            /* extension headers that describe nothing */
+            return sc->pos == e->start ? 0 : scan_fail(sc, SCAN_MALFORMED);
+        }
+        call.headers++;
+        sc->headers++;
+
+        int bad = check_header(&e->h, sc->check);
+        if (bad) return scan_fail(sc, bad);
+        sc->pos += BLOCKSIZE;
+
+        char type = e->h.typeflag;
+        if (type != PAX_HEADER && type != PAX_GLOBAL && type != GNU_LONGNAME && type != GNU_LONGLINK) break;
+
+        off_t n = (off_t)TAR_INT(e->h.size);
+        if (n < 0 || n > TAR_EXT_MAX) return scan_fail(sc, SCAN_MALFORMED);
+        if ((size_t)n + 1 > sc->ext_cap) {
+            char *grown = realloc(sc->ext, (size_t)n + 1);
+            if (!grown) return scan_fail(sc, SCAN_MALFORMED);
+            sc->ext = grown;
+            sc->ext_cap = (size_t)n + 1;
+        }
+        if (src_pread(sc->src, sc->ext, (size_t)n, sc->pos) != (ssize_t)n) return scan_fail(sc, SCAN_TRUNCATED);
+        sc->ext[n] = '\0';
+        sc->pos += round_up_512(n);
+
+        int r = 0;
+        if (type == PAX_HEADER) {
+            r = pax_apply(e, sc->ext, (size_t)n, &found);
+        } else if (type == GNU_LONGNAME) {
+            r = str_set(&e->path, &e->path_cap, sc->ext, (size_t)n);
+            found |= 1;
+        } else if (type == GNU_LONGLINK) {
+            r = str_set(&e->link, &e->link_cap, sc->ext, (size_t)n);
+            found |= 2;
+        }
+        if (r == -1) return scan_fail(sc, SCAN_MALFORMED);
+    }
+
+    if (!(found & 1)) {
+        char path[PATHBUF];
+        if (header_path(&e->h, path) == -1 || str_set(&e->path, &e->path_cap, path, sizeof(path)) == -1) {
+            return scan_fail(sc, SCAN_MALFORMED);
+        }
+    }
+    if (!(found & 2) && str_set(&e->link, &e->link_cap, e->h.linkname, sizeof(e->h.linkname)) == -1) {
+        return scan_fail(sc, SCAN_MALFORMED);
+    }
+    if (!(found & 4)) e->size = (off_t)TAR_INT(e->h.size);
+    if (e->size < 0) return scan_fail(sc, SCAN_MALFORMED);
+
+    e->data = sc->pos;
+    sc->pos += round_up_512(e->size);
+    sc->skip = e->size;
+    return 1;
+}
+
+/*
+ * Entry index. Queries run on an index of the archive built by one scan and
+ * kept for the next calls in a small cache keyed, like the gzip states, by the
+ * file's identity (one index per file, shared by whoever references it).
+ * Each entry is decoded once into a compact record, with its path (followed
+ * by its link target) interned in one string arena, and the record ids
+ * sorted by path serve lookups by binary search. When the archive
+ * has only grown since (appends write past the old end, so the last header
+ * indexed is still in place), the index is brought up to date by scanning the
+ * new entries alone.
+ */
+
+#define INDEX_CACHE_MAX 8             /* archives whose index we keep */
+#define NO_ENTRY UINT32_MAX
+
+struct entry_rec {
+    int64_t start;                    /* first header, extension headers included */
+    int64_t size;                     /* size of the data */
+    int64_t mtime;
+    uint64_t path;                    /* offset of the path in the arena, its link target follows */
+    uint32_t hdr;                     /* bytes of headers: the data starts at start + hdr */
+    uint16_t mode;
+    char type;
+};
+
+struct tar_index {
+    uint64_t dev;
+    uint64_t ino;
+    int built;
+    off_t fsize;                      /* size and mtime of the file when last brought up to date */
+    struct timespec mtime;
+    off_t limit;                      /* end of the snapshot it was built on */
+    int gz;
+    int complete;                     /* the scan reached the end of the archive... */
+    off_t end;                        /* ...at this zero block */
+    tar_header_t tail;                /* last header indexed, to tell an append from a rewrite */
+    int stale;                        /* set by our own writes, atomic */
+    int refs;                         /* under index_cache_lock */
+    int cached;
+    struct tar_index *next;           /* in index_list */
+    pthread_rwlock_t lock;            /* shared by queries, exclusive to update the index */
+    struct entry_rec *recs;           /* in archive order */
+    uint32_t *by_path;                /* record ids sorted by path, then archive order */
+    uint32_t n;
+    size_t cap;
+    char *arena;
+    size_t arena_len;
+    size_t arena_cap;
+};
+
+/* The index as one call sees it: the records of the entries in its snapshot. */
+struct index_view {
+    struct tar_index *idx;
+    uint32_t n;
+};
+
+static struct tar_index *index_cache[INDEX_CACHE_MAX];   /* kept after their last reference */
+static struct tar_index *index_list;                    /* every index alive */
+static pthread_mutex_t index_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread const struct tar_index *sort_index;   /* for cmp_ids() */
+
+static const char *rec_path(const struct tar_index *idx, uint32_t id) {
+    return idx->arena + idx->recs[id].path;
+}
+
+static const char *rec_link(const struct tar_index *idx, uint32_t id) {
+    const char *path = rec_path(idx, id);
+    return path + strlen(path) + 1;
+}
+
+static void index_clear(struct tar_index *idx) {
+    free(idx->recs);
+    free(idx->by_path);
+    free(idx->arena);
+    idx->recs = NULL;
+    idx->by_path = NULL;
+    idx->arena = NULL;
+    idx->n = 0;
+    idx->cap = idx->arena_len = idx->arena_cap = 0;
+    idx->built = idx->complete = 0;
+    idx->end = 0;
+}
+
+/* Under index_cache_lock. */
+static void index_free(struct tar_index *idx) {
+    struct tar_index **p = &index_list;
+    while (*p != idx) p = &(*p)->next;
+    *p = idx->next;
+    index_clear(idx);
+    pthread_rwlock_destroy(&idx->lock);
+    free(idx);
+}
+
+static int arena_add(struct tar_index *idx, const char *s) {
+    size_t len = strlen(s) + 1;
+    if (idx->arena_len + len > idx->arena_cap) {
+        size_t cap = idx->arena_cap ? 2 * idx->arena_cap : 64 * 1024;
+        while (cap < idx->arena_len + len) cap *= 2;
+        char *grown = realloc(idx->arena, cap);
+        if (!grown) return -1;
+        idx->arena = grown;
+        idx->arena_cap = cap;
+    }
+    memcpy(idx->arena + idx->arena_len, s, len);
+    idx->arena_len += len;
+    return 0;
+}
+
+static int cmp_ids(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    int c = strcmp(rec_path(sort_index, x), rec_path(sort_index, y));
+    return c ? c : (x > y) - (x < y);
+}
+
+static int cmp_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+/* Indexes the entries from offset from on and merges them into by_path.
+   A scan error leaves the index incomplete, with the entries before it. */
+static int index_scan(struct tar_index *idx, struct tar_src *src, off_t from) {
+    uint32_t first = idx->n;
+    struct tar_scan sc;
+    int r;
+
+    scan_begin(&sc, src, 0);
+    sc.pos = from;
+    while ((r = scan_next(&sc)) == 1) {
+        if (idx->n == idx->cap) {
+            size_t cap = idx->cap ? 2 * idx->cap : 1024;
+            struct entry_rec *grown = cap < NO_ENTRY ? realloc(idx->recs, cap * sizeof(*grown)) : NULL;
+            if (!grown) goto fail;
+            idx->recs = grown;
+            idx->cap = cap;
+        }
+        struct entry_rec *rec = &idx->recs[idx->n];
+        rec->path = idx->arena_len;
+        if (arena_add(idx, sc.e.path) == -1 || arena_add(idx, sc.e.link) == -1) goto fail;
+        rec->start = sc.e.start;
+        rec->size = sc.e.size;
+        rec->mtime = (int64_t)TAR_INT(sc.e.h.mtime);
+        rec->hdr = (uint32_t)(sc.e.data - sc.e.start);
+        rec->mode = (uint16_t)TAR_INT(sc.e.h.mode);
+        rec->type = sc.e.h.typeflag;
+        idx->tail = sc.e.h;
+        idx->n++;
+    }
+    idx->complete = r == 0;
+    idx->end = sc.pos;
+    scan_end(&sc);
+
+    /* sort the new ids, then merge them from the back with the old ones,
+       which come first among equal paths */
+    uint32_t added = idx->n - first;
+    uint32_t *by_path = realloc(idx->by_path, ((size_t)idx->n + 1) * sizeof(*by_path));
+    uint32_t *ids = malloc(((size_t)added + 1) * sizeof(*ids));
+    if (by_path) idx->by_path = by_path;
+    if (!by_path || !ids) {
+        free(ids);
+        index_clear(idx);
+        return -1;
+    }
+    for (uint32_t i = 0; i < added; i++) ids[i] = first + i;
+    sort_index = idx;
+    qsort(ids, added, sizeof(*ids), cmp_ids);
+
+    size_t i = first, j = added, k = idx->n;
+    while (j > 0) {
+        if (i > 0 && cmp_ids(&by_path[i - 1], &ids[j - 1]) > 0) by_path[--k] = by_path[--i];
+        else by_path[--k] = ids[--j];
+    }
+    free(ids);
+    idx->built = 1;
+    return 0;
+
+fail:
+    /* out of memory: a truncated index would answer "not found" for what it missed */
+    scan_end(&sc);
+    index_clear(idx);
+    return -1;
+}
+
+/* Whether what the index covers is still in place: its last header is. */
+static int index_intact(const struct tar_index *idx, struct tar_src *src) {
+    if (!idx->built || !idx->complete || idx->gz || src->gz) return 0;
+    if (idx->n == 0) return 1;
+
+    const struct entry_rec *last = &idx->recs[idx->n - 1];
+    tar_header_t h;
+    return src_pread(src, &h, sizeof(h), last->start + last->hdr - BLOCKSIZE) == (ssize_t)sizeof(h)
+           && memcmp(&h, &idx->tail, sizeof(h)) == 0;
+}
+
+static int index_fresh(const struct tar_index *idx, const struct stat *st, off_t limit) {
+    return idx->built && !__atomic_load_n(&idx->stale, __ATOMIC_ACQUIRE) && idx->fsize == st->st_size && idx->mtime.tv_sec == st->st_mtim.tv_sec
+           && idx->mtime.tv_nsec == st->st_mtim.tv_nsec && limit <= idx->limit;
+}
+
+/* Marks the index of the archive behind fd out of date after we wrote to it:
+   the write may leave the file's size (within the padding of the last record)
+   and mtime (which ticks coarsely) as they were. */
+static void index_stale(int fd) {
+    struct stat st;
+    call.syscalls++;
+    if (fstat(fd, &st) == -1) return;
+
+    pthread_mutex_lock(&index_cache_lock);
+    for (struct tar_index *idx = index_list; idx; idx = idx->next) {
+        if (idx->dev == (uint64_t)st.st_dev && idx->ino == (uint64_t)st.st_ino)
+            __atomic_store_n(&idx->stale, 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&index_cache_lock);
+}
+
+/* Number of records of the entries starting before limit. */
+static uint32_t index_count(const struct tar_index *idx, off_t limit) {
+    uint32_t lo = 0, hi = idx->n;
+    if (limit >= idx->limit) return idx->n;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (idx->recs[mid].start < limit) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+/* Returns a reference on the index of the file st describes, creating it (empty)
+   if needed, and keeping a new one in the cache if cache is set. NULL on error. */
+static struct tar_index *index_acquire(const struct stat *st, int cache) {
+    pthread_mutex_lock(&index_cache_lock);
+    struct tar_index *idx = index_list;
+    while (idx && (idx->dev != (uint64_t)st->st_dev || idx->ino != (uint64_t)st->st_ino)) idx = idx->next;
+    if (!idx) {
+        idx = calloc(1, sizeof(*idx));
+        if (!idx) {
+            pthread_mutex_unlock(&index_cache_lock);
+            return NULL;
+        }
+        idx->dev = st->st_dev;
+        idx->ino = st->st_ino;
+        pthread_rwlock_init(&idx->lock, NULL);
+        idx->next = index_list;
+        index_list = idx;
+    }
+    if (cache && !idx->cached) {
+        int slot = -1;
+        for (int i = 0; slot == -1 && i < INDEX_CACHE_MAX; i++) {
+            if (!index_cache[i]) slot = i;
+        }
+        for (int i = 0; slot == -1 && i < INDEX_CACHE_MAX; i++) {
+            if (index_cache[i]->refs == 0) {
+                index_free(index_cache[i]);
+                index_cache[i] = NULL;
+                slot = i;
+            }
+        }
+        if (slot != -1) {
+            idx->cached = 1;
+            index_cache[slot] = idx;
+        }
+    }
+    idx->refs++;
+    pthread_mutex_unlock(&index_cache_lock);
+    return idx;
+}
+
+static void index_release(struct tar_index *idx) {
+    pthread_mutex_lock(&index_cache_lock);
+    if (--idx->refs == 0 && !idx->cached) index_free(idx);
+    pthread_mutex_unlock(&index_cache_lock);
+}
+
+/* Brings idx up to date with the snapshot src reads, st being the file's status,
+   and locks it for the call until index_unlock(). Returns 0 on success, -1 on error. */
+static int index_lock(struct tar_index *idx, struct tar_src *src, const struct stat *st, struct index_view *v) {
+    off_t limit = src->limit < st->st_size ? src->limit : st->st_size;
+    v->idx = idx;
+
+    pthread_rwlock_rdlock(&idx->lock);
+    if (index_fresh(idx, st, limit)) {
+        call.cache_hits++;
+        v->n = index_count(idx, limit);
+        return 0;
+    }
+    pthread_rwlock_unlock(&idx->lock);
+
+    /* update it, and keep it locked for the rest of the call */
+    pthread_rwlock_wrlock(&idx->lock);
+    int r = 0;
+    if (index_fresh(idx, st, limit)) {
+        call.cache_hits++;
+    } else if (limit < st->st_size && idx->complete && limit <= idx->end && index_intact(idx, src)) {
+        /* our snapshot ends before the zero block the last scan stopped at, and
+           appends only write past it: the index serves as is. It is known good up
+           to that block, with the file as we found it, so that the next readers
+           stay on the shared lock while an appender keeps growing it */
+        idx->limit = idx->end;
+        idx->fsize = st->st_size;
+        idx->mtime = st->st_mtim;
+    } else {
+        __atomic_store_n(&idx->stale, 0, __ATOMIC_RELEASE);
+        if (index_intact(idx, src)) {
+            /* appended to: index the new entries */
+            r = index_scan(idx, src, idx->end);
+        } else {
+            index_clear(idx);
+            idx->gz = src->gz != NULL;
+            r = index_scan(idx, src, 0);
+        }
+        idx->limit = limit;
+        idx->fsize = st->st_size;
+        idx->mtime = st->st_mtim;
+    }
+    if (r == -1) {
+        pthread_rwlock_unlock(&idx->lock);
+        return -1;
+    }
+    v->n = index_count(idx, limit);
+    return 0;
+}
+
+/* Like index_lock(), but only takes idx if it is up to date and no writer holds
+   it: returns 1, holding nothing, when it is not. */
+static int index_lock_fresh(struct tar_index *idx, struct tar_src *src, const struct stat *st, struct index_view *v) {
+    off_t limit = src->limit < st->st_size ? src->limit : st->st_size;
+    if (pthread_rwlock_tryrdlock(&idx->lock) != 0) return 1;
+    if (!index_fresh(idx, st, limit)) {
+        pthread_rwlock_unlock(&idx->lock);
+        return 1;
+    }
+    call.cache_hits++;
+    v->idx = idx;
+    v->n = index_count(idx, limit);
+    return 0;
+}
+
+static void index_unlock(struct index_view *v) {
+    pthread_rwlock_unlock(&v->idx->lock);
+}
+
+/* Gets the index of the archive behind src, up to date with the snapshot src
+   reads, and locked for the call until index_put(). Returns 0 on success, -1 on error. */
+static int index_get(struct tar_src *src, struct index_view *v) {
+    struct stat st;
+    call.syscalls++;
+    if (fstat(src->fd, &st) == -1) return -1;
+
+    struct tar_index *idx = index_acquire(&st, 1);
+    if (!idx) return -1;
+    if (index_lock(idx, src, &st, v) == -1) {
+        index_release(idx);
+        return -1;
+    }
+    return 0;
+}
+
+static void index_put(struct index_view *v) {
+    index_unlock(v);
+    index_release(v->idx);
+}
+
+/* Compares path with the len bytes of key, like strcmp(). */
+static int key_cmp(const char *path, const char *key, size_t len) {
+    int c = strncmp(path, key, len);
+    return c ? c : path[len] != '\0';
+}
+
+/* First position in [lo, hi) of by_path whose path is not below the len bytes of
+   key, or, with prefix, not below every path starting with them. */
+static size_t index_bound(const struct tar_index *idx, size_t lo, size_t hi, const char *key, size_t len, int prefix) {
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        const char *path = rec_path(idx, idx->by_path[mid]);
+        int c = prefix ? strncmp(path, key, len) : key_cmp(path, key, len);
+        if (c < 0 || (prefix && c == 0)) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+/* Record id of the first entry of the view whose path is the len bytes of path, or NO_ENTRY. */
+static uint32_t index_first(const struct index_view *v, const char *path, size_t len) {
+    const struct tar_index *idx = v->idx;
+    size_t i = index_bound(idx, 0, idx->n, path, len, 0);
+    if (i == idx->n) return NO_ENTRY;
+
+    /* copies of a path are sorted in archive order */
+    uint32_t id = idx->by_path[i];
+    return id < v->n && key_cmp(rec_path(idx, id), path, len) == 0 ? id : NO_ENTRY;
+}
+
+/* Copy of s with a trailing slash, to be freed. */
+static char *with_slash(const char *s) {
+    size_t len = strlen(s);
+    char *slashed = malloc(len + 2);
+    if (!slashed) return NULL;
+    memcpy(slashed, s, len);
+    slashed[len] = '/';
+    slashed[len + 1] = '\0';
+    return slashed;
+}
+
+/* Record id of the entry path names in the view, without following symlinks: the
+   first in archive order at path, or, with a trailing slash, at path without it
+   (a directory stored without its slash, or a symlink to one). NO_ENTRY if none. */
+static uint32_t find_record(const struct index_view *v, const char *path) {
+    size_t plen = strlen(path);
+    uint32_t found = index_first(v, path, plen);
+    if (plen > 0 && path[plen - 1] == '/') {
+        uint32_t bare = index_first(v, path, plen - 1);
+        if (bare < found) found = bare;
+    }
+    return found;
+}
+
+/* Whether find_record() found a symlink named without the trailing slash of path,
+   which must then be followed. */
+static int slashed_symlink(const struct index_view *v, uint32_t id, const char *path) {
+    return v->idx->recs[id].type == SYMTYPE && strlen(rec_path(v->idx, id)) + 1 == strlen(path);
+}
+
+static int find_entry_hops(const struct index_view *v, const char *path, uint32_t *id, int hops) {
     if (!path) return -1;
-    if (lseek(tar_fd, 0, SEEK_SET) == (off_t)-1) return -1;
 
-    tar_header_t h;
-    char fullpath[512];
+    uint32_t found = find_record(v, path);
+    if (found == NO_ENTRY) return v->idx->complete ? 0 : -1;
+
+    // if path is fullpath + "/", we might have found a symlink directory
+    // so we check if it is a symlink and if so, we resolve it to its target
+    if (slashed_symlink(v, found, path)) {
+        if (hops == MAX_SYMLINK_HOPS) return -1;
+        call.symlink_hops++;
+
+        /* try resolving the symlink to its target entry, then with a trailing slash */
+        const char *link = rec_link(v->idx, found);
+        int r = find_entry_hops(v, link, id, hops + 1);
+        if (r == 0) {
+            char *target = with_slash(link);
+            r = target ? find_entry_hops(v, target, id, hops + 1) : -1;
+            free(target);
+        }
+        return r;
+    }
+
+    /* otherwise the header represents the entry (or the directory, with the trailing slash) */
+    *id = found;
+    return 1;
+}
+
+/* Looks up path in the view, resolving a symlink when path names it with a
+   trailing slash. Returns 1 with the record id in *id if found, 0 if not, -1 on
+   error (as when the index stops at a corrupt header). */
+static int find_entry(const struct index_view *v, const char *path, uint32_t *id) {
+    return find_entry_hops(v, path, id, 0);
+}
+
+/* Like find_entry(), then follows the symlink found, if any, to the entry at the
+   end of the chain. */
+static int resolve_entry(const struct index_view *v, const char *path, uint32_t *id) {
+    int r = find_entry(v, path, id);
+
+    for (int hops = 0; r == 1 && v->idx->recs[*id].type == SYMTYPE; hops++) {
+        if (hops == MAX_SYMLINK_HOPS) return -1;
+        call.symlink_hops++;
+
+        const char *target = rec_link(v->idx, *id);
+        r = find_entry(v, target, id);
+        if (r == 0) {
+            /* directories are stored with a trailing slash */
+            char *dir = with_slash(target);
+            r = dir ? find_entry(v, dir, id) : -1;
+            free(dir);
+        }
+    }
+    return r;
+}
+
+static int do_check_archive(struct tar_src *src) {
+    struct tar_scan sc;
+    int r;
+
+    scan_begin(&sc, src, SCAN_STRICT);
+    while ((r = scan_next(&sc)) == 1) continue;
+
+    if (r == 0) {
+        /* the archive is closed by two zero blocks */
+        tar_header_t h2;
+        ssize_t r2 = src_pread(src, &h2, sizeof(h2), sc.pos + BLOCKSIZE);
+        r = (r2 == (ssize_t)sizeof(h2) && is_zero_block((const uint8_t *)&h2)) ? sc.headers : -3;
+    } else {
+        r = (sc.err == SCAN_BAD_MAGIC || sc.err == SCAN_BAD_VERSION) ? sc.err : -3;
+    }
+    scan_end(&sc);
+    return r;
+}
+
+/**
+ * Checks whether the archive is valid.
+ *
+ * Each non-null header of a valid archive has:
+ *  - a magic value of "ustar" and a null, and a version value of "00" and no null,
+ *    or GNU tar's magic value of "ustar " and a version value of " " and a null,
+ *  - a correct checksum
+ *
+ * @param tar_fd A file descriptor pointing to the start of a file supposed to contain a tar archive.
+ *
+ * @return a zero or positive value if the archive is valid, representing the number of non-null headers in the archive,
+ *         -1 if the archive contains a header with an invalid magic value,
+ *         -2 if the archive contains a header with an invalid version value,
+ *         -3 if the archive contains a header with an invalid checksum value
+ */
+int check_archive(int tar_fd) {
+    struct tar_src src;
+    int ret = -3;
+    stats_begin(TAR_OP_CHECK_ARCHIVE);
+    if (src_open(&src, tar_fd) == 0) ret = do_check_archive(&src);
+    src_close(&src);
+    stats_end();
+    return ret;
+}
+
+/* find_entry() through the index of tar_fd, for the one-shot lookups below. */
+static int lookup(int tar_fd, const char *path, struct entry_rec *out) {
+    struct tar_src src;
+    struct index_view v;
+    uint32_t id;
+    int ret = -1;
+    if (src_open(&src, tar_fd) == 0 && index_get(&src, &v) == 0) {
+        ret = find_entry(&v, path, &id);
+        if (ret == 1) *out = v.idx->recs[id];
+        index_put(&v);
+    }
+    src_close(&src);
+    return ret;
+}
+
+static int do_exists(const struct index_view *v, const char *path) {
+    if (index_first(v, path, strlen(path)) != NO_ENTRY) return 1;
+    return v->idx->complete ? 0 : -1;
+}
+
+/**
+ * Checks whether an entry exists in the archive.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ * @param path A path to an entry in the archive.
+ *
+ * @return zero if no entry at the given path exists in the archive,
+ *         any other value otherwise.
+ */
+int exists(int tar_fd, char *path) {
+    // TODO
+    if (path == NULL) return -1;
+
+    struct tar_src src;
+    struct index_view v;
+    int ret = -1;
+    stats_begin(TAR_OP_EXISTS);
+    if (src_open(&src, tar_fd) == 0 && index_get(&src, &v) == 0) {
+        ret = do_exists(&v, path);
+        index_put(&v);
+    }
+    src_close(&src);
+    stats_end();
+    return ret;
+}
+
+/**
+ * Checks whether an entry exists in the archive and is a directory.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ * @param path A path to an entry in the archive.
+ *
+ * @return zero if no entry at the given path exists in the archive or the entry is not a directory,
+ *         any other value otherwise.
+ */
+int is_dir(int tar_fd, char *path) {
+    // TODO
+    struct entry_rec e;
+    stats_begin(TAR_OP_IS_DIR);
+    int r = lookup(tar_fd, path, &e);
+    stats_end();
+    return (r == 1 && (e.type == DIRTYPE)) ? 1 : 0;
+}
+
+/**
+ * Checks whether an entry exists in the archive and is a file.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ * @param path A path to an entry in the archive.
+ *
+ * @return zero if no entry at the given path exists in the archive or the entry is not a file,
+ *         any other value otherwise.
+ */
+int is_file(int tar_fd, char *path) {
+    // TODO
+    struct entry_rec e;
+    stats_begin(TAR_OP_IS_FILE);
+    int r = lookup(tar_fd, path, &e);
+    stats_end();
+    return (r == 1 && (e.type == REGTYPE || e.type == AREGTYPE)) ? 1 : 0;
+}
+
+/**
+ * Checks whether an entry exists in the archive and is a symlink.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ * @param path A path to an entry in the archive.
+ * @return zero if no entry at the given path exists in the archive or the entry is not symlink,
+ *         any other value otherwise.
+ */
+int is_symlink(int tar_fd, char *path) {
+    // TODO
+    struct entry_rec e;
+    stats_begin(TAR_OP_IS_SYMLINK);
+    int r = lookup(tar_fd, path, &e);
+    stats_end();
+    return (r == 1 && (e.type == SYMTYPE)) ? 1 : 0;
+}
+
+/* Collects the ids of the direct children of the directory prefix (with its
+   trailing slash, "" for the root) visible in the view, in archive order, into
+   *ids to be freed. Returns 0 on success, -1 on error. */
+static int list_children(const struct index_view *v, const char *prefix, uint32_t **ids_out, size_t *count_out) {
+    const struct tar_index *idx = v->idx;
+
+    /* the children sit among the paths starting with the directory's, where the
+       subtree of each child directory is skipped in one binary search */
+    size_t plen = strlen(prefix);
+    size_t end = index_bound(idx, 0, idx->n, prefix, plen, 1);
+    size_t i = index_bound(idx, 0, end, prefix, plen, 0);
+    uint32_t *ids = NULL;
+    size_t count = 0, cap = 0;
+
+    while (i < end) {
+        uint32_t id = idx->by_path[i];
+        const char *entry = rec_path(idx, id);
+        if (is_direct_child(entry, prefix)) {
+            if (id < v->n) {
+                if (count == cap) {
+                    cap = cap ? 2 * cap : 64;
+                    uint32_t *grown = realloc(ids, cap * sizeof(*ids));
+                    if (!grown) {
+                        free(ids);
+                        return -1;
+                    }
+                    ids = grown;
+                }
+                ids[count++] = id;
+            }
+            i++;
+            continue;
+        }
+        const char *slash = strchr(entry + plen, '/');
+        i = slash ? index_bound(idx, i + 1, end, entry, (size_t)(slash + 1 - entry), 1) : i + 1;
+    }
+
+    if (count) qsort(ids, count, sizeof(*ids), cmp_u32);
+    *ids_out = ids;
+    *count_out = count;
+    return 0;
+}
+
+static int do_list(const struct index_view *v, char *path, char **entries, size_t *no_entries) {
+    const struct tar_index *idx = v->idx;
+    // if path is NULL, list the tar root
+    char *list_path = NULL;   // directory listed, with a trailing slash
+
+    if (path != NULL && strcmp(path, "") != 0) {
+        // resolve symlink to linked-to entry
+        uint32_t dir;
+        int r = resolve_entry(v, path, &dir);
+        if (r == -1) return -1;
+
+        // needs to return 0 if no directory at the given path exists in the archive
+        if (r != 1 || idx->recs[dir].type != DIRTYPE) {
+            *no_entries = 0;
+            return 0;
+        }
+
+        // être sûr d'avoir un slash à la fin
+        const char *dir_path = rec_path(idx, dir);
+        size_t len = strlen(dir_path);
+        list_path = (len && dir_path[len - 1] == '/') ? strdup(dir_path) : with_slash(dir_path);
+        if (!list_path) return -1;
+    }
+
+    uint32_t *ids = NULL;
+    size_t count = 0;
+    int ret = list_children(v, list_path ? list_path : "", &ids, &count) == -1 ? -1 : 1;
+    free(list_path);
+
+    /* listed in archive order, as a scan would */
+    size_t number_of_entries = 0;
+    if (ret == 1) {
+        number_of_entries = count < *no_entries ? count : *no_entries;
+        for (size_t k = 0; ret == 1 && k < number_of_entries; k++) {
+            const char *entry = rec_path(idx, ids[k]);
+            size_t len = strlen(entry) + 1;
+            if (len > TAR_PATH_MAX) ret = -1;   // plus long que les tampons de l'appelant
+            else memcpy(entries[k], entry, len);
+        }
+        // an index cut short by a corrupt header may miss some
+        if (number_of_entries < *no_entries && !idx->complete) ret = -1;
+    }
+    free(ids);
+
+    *no_entries = number_of_entries;
+    return ret; // needs to return 1 if success
+}
+
+/**
+ * Lists the entries at a given path in the archive.
+ * list() does *not* recurse into the directories listed at the given path.
+ * If the path is NULL, it lists the entries at the root of the archive.
+ *
+ * Example:
+ *  dir/          list(..., "dir/", ...) lists "dir/a", "dir/b", "dir/c/" and "dir/e/"
+ *   ├── a
+ *   ├── b
+ *   ├── c/
+ *   │   └── d
+ *   └── e/
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ * @param path A path to an entry in the archive. If the entry is a symlink, it must be resolved to its linked-to entry.
+ * @param entries An array of char arrays of TAR_PATH_MAX bytes each. An entry path longer than that
+ *                (PAX or GNU long names are not bounded by the 255 bytes of a ustar header) makes list() fail.
+ * @param no_entries An in-out argument.
+ *                   The caller set it to the number of entries in `entries`.
+ *                   The callee set it to the number of entries listed.
+ *
+ * @return zero if no directory at the given path exists in the archive,
+ *         1 in case of success,
+ *         -1 in case of error.
+ */
+int list(int tar_fd, char *path, char **entries, size_t *no_entries) {
+    // pas besoin de checker l'archive, on suppose qu'elle est valide
+
+    if (no_entries == NULL || entries == NULL) return -1;
+
+    struct tar_src src;
+    struct index_view v;
+    int ret = -1;
+    stats_begin(TAR_OP_LIST);
+    if (src_open(&src, tar_fd) == 0 && index_get(&src, &v) == 0) {
+        ret = do_list(&v, path, entries, no_entries);
+        index_put(&v);
+    }
+    src_close(&src);
+    stats_end();
+    return ret;
+}
+
+/* Reads the data of the file entry e from offset on, like read_file(). */
+static ssize_t read_rec(struct tar_src *src, const struct entry_rec *e, size_t offset, uint8_t *dest, size_t *len) {
+    size_t size = (size_t)e->size;
+    if (offset > size) return -2;
+
+    size_t n = size - offset;
+    if (n > *len) n = *len;
+    off_t at = e->start + e->hdr + (off_t)offset;
+    if (src_pread(src, dest, n, at) != (ssize_t)n) return -1;
+    src_dontneed(src, at, n);
+
+    *len = n;
+    return (ssize_t)(size - offset - n);
+}
+
+static ssize_t do_read_file(struct tar_src *src, const struct index_view *v, const char *path, size_t offset,
+                            uint8_t *dest, size_t *len) {
+    uint32_t id;
+
+    // follow symlinks to the entry they point to
+    if (resolve_entry(v, path, &id) != 1) return -1;
+    const struct entry_rec *e = &v->idx->recs[id];
+    if (e->type != REGTYPE && e->type != AREGTYPE) return -1;
+    return read_rec(src, e, offset, dest, len);
+}
+
+/**
+ * Reads a file at a given path in the archive.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ * @param path A path to an entry in the archive to read from. If the entry is a symlink, it must be resolved to its linked-to entry.
+ * @param offset An offset in the file from which to start reading from, zero indicates the start of the file.
+ * @param dest A destination buffer to read the given file into.
+ * @param len An in-out argument.
+ *            The caller set it to the size of dest.
+ *            The callee set it to the number of bytes written to dest.
+ *
+ * @return -1 if no entry at the given path exists in the archive or the entry is not a file,
+ *         -2 if the offset is outside the file total length,
+ *         zero if the file was read in its entirety into the destination buffer,
+ *         a positive value if the file was partially read, representing the remaining bytes left to be read to reach
+ *         the end of the file.
+ */
+ssize_t read_file(int tar_fd, char *path, size_t offset, uint8_t *dest, size_t *len) {
+    if (!path || !dest || !len) return -1;
+
+    struct tar_src src;
+    struct index_view v;
+    ssize_t ret = -1;
+    stats_begin(TAR_OP_READ_FILE);
+    if (src_open(&src, tar_fd) == 0 && index_get(&src, &v) == 0) {
+        ret = do_read_file(&src, &v, path, offset, dest, len);
+        index_put(&v);
+    }
+    src_close(&src);
+    stats_end();
+    return ret;
+}
+
+/*
+ * Pattern queries. tar_find() runs on the entry index: a pattern's literal head
+ * bounds the range of by_path to look at, and inside it a directory whose name
+ * cannot match is skipped with everything under it by a binary search to the end
+ * of its subtree.
+ */
+
+/* Matches the component [s, se) against the pattern component [p, pe),
+   which holds no '/': '*' matches any run of characters, '?' one character,
+   [...] one of a set ([!...] or [^...] one out of it), '\' escapes. */
+static int match_component(const char *p, const char *pe, const char *s, const char *se) {
+    const char *star_p = NULL, *star_s = NULL;
+
+    while (s < se) {
+        if (p < pe && *p == '*') {
+            while (p < pe && *p == '*') p++;
+            star_p = p;
+            star_s = s;
+            continue;
+        }
+        if (p < pe) {
+            const char *next = p + 1;
+            int ok;
+            if (*p == '?') {
+                ok = 1;
+            } else if (*p == '[') {
+                const char *c = p + 1;
+                int negate = c < pe && (*c == '!' || *c == '^');
+                if (negate) c++;
+                ok = 0;
+                const char *first = c;
+                while (c < pe && (*c != ']' || c == first)) {
+                    char lo = *c, hi = *c;
+                    if (c + 2 < pe && c[1] == '-' && c[2] != ']') {
+                        hi = c[2];
+                        c += 2;
+                    }
+                    if ((unsigned char)*s >= (unsigned char)lo && (unsigned char)*s <= (unsigned char)hi) ok = 1;
+                    c++;
+                }
+                if (c == pe) {
+                    ok = *s == '[';           /* no closing bracket: a plain '[' */
+                } else {
+                    ok ^= negate;
+                    next = c + 1;
+                }
+            } else if (*p == '\\' && p + 1 < pe) {
+                ok = p[1] == *s;
+                next = p + 2;
+            } else {
+                ok = *p == *s;
+            }
+            if (ok) {
+                p = next;
+                s++;
+                continue;
+            }
+        }
+        /* mismatch: let the last star take one more character */
+        if (!star_p) return 0;
+        p = star_p;
+        s = ++star_s;
+    }
+    while (p < pe && *p == '*') p++;
+    return p == pe;
+}
+
+static const char *component_end(const char *s) {
+    const char *slash = strchr(s, '/');
+    return slash ? slash : s + strlen(s);
+}
+
+/* Matches path against pattern component by component, a "**" component
+   matching any number of path components (at least one at the end of the pattern).
+   Neither has a trailing slash. */
+static int match_path(const char *p, const char *s) {
+    while (1) {
+        const char *pe = component_end(p);
+        if (pe - p == 2 && p[0] == '*' && p[1] == '*') {
+            if (!*pe) return *s != '\0';
+            for (const char *t = s;; t++) {
+                if (match_path(pe + 1, t)) return 1;
+                t = strchr(t, '/');
+                if (!t) return 0;
+            }
+        }
+        if (!*s && *p) return 0;
+
+        const char *se = component_end(s);
+        if (!match_component(p, pe, s, se)) return 0;
+        if (!*pe || !*se) return !*pe && !*se;
+        p = pe + 1;
+        s = se + 1;
+    }
+}
+
+/* Length of the leading directories of path that no path starting with them can
+   match the pattern with: the first directory a pattern component rejects, or the
+   directory the pattern ends at. 0 when it cannot be told without a "**". */
+static size_t prune_length(const char *p, const char *path) {
+    const char *s = path;
+    while (1) {
+        const char *pe = component_end(p);
+        const char *se = component_end(s);
+        if (!*se) return 0;                          /* the last component of path */
+        if (pe - p == 2 && p[0] == '*' && p[1] == '*') return 0;
+        if (!*pe || !match_component(p, pe, s, se)) return (size_t)(se + 1 - path);
+        p = pe + 1;
+        s = se + 1;
+    }
+}
+
+static int do_find(struct tar_src *src, const char *pattern, tar_find_cb cb, void *arg) {
+    /* a trailing slash asks for directories, which are matched without theirs */
+    size_t plen = strlen(pattern);
+    int dirs_only = plen > 1 && pattern[plen - 1] == '/';
+    char *pat = strndup(pattern, dirs_only ? plen - 1 : plen);
+    char *path = NULL;
+    size_t path_cap = 0;
+    if (!pat) return -1;
+
+    struct index_view v;
+    if (index_get(src, &v) == -1) {
+        free(pat);
+        return -1;
+    }
+    const struct tar_index *idx = v.idx;
+
+    /* literal head of the pattern: every match starts with it */
+    size_t head = strcspn(pat, "*?[\\");
+    size_t i = index_bound(idx, 0, idx->n, pat, head, 0);
+    size_t end = index_bound(idx, i, idx->n, pat, head, 1);
+
+    /* the matches are gathered first, so that cb may call us back on the archive */
+    char *matches = NULL;
+    size_t matches_len = 0, matches_cap = 0;
+    int found = 0;
+
+    while (i < end) {
+        uint32_t id = idx->by_path[i];
+        const char *entry = rec_path(idx, id);
+        size_t len = strlen(entry);
+        int is_dir = len > 0 && entry[len - 1] == '/';
+
+        /* a later copy of the same path, or an entry past our snapshot */
+        if (id >= v.n || (i > 0 && idx->by_path[i - 1] < v.n && strcmp(entry, rec_path(idx, idx->by_path[i - 1])) == 0)) {
+            i++;
+            continue;
+        }
+        if (str_set(&path, &path_cap, entry, is_dir ? len - 1 : len) == -1) {
+            found = -1;
+            break;
+        }
+
+        if ((!dirs_only || is_dir) && match_path(pat, path)) {
+            if (matches_len + len + 1 > matches_cap) {
+                size_t cap = matches_cap ? 2 * matches_cap : 4096;
+                while (cap < matches_len + len + 1) cap *= 2;
+                char *grown = realloc(matches, cap);
+                if (!grown) {
+                    found = -1;
+                    break;
+                }
+                matches = grown;
+                matches_cap = cap;
+            }
+            memcpy(matches + matches_len, entry, len + 1);
+            matches_len += len + 1;
+            found++;
+        }
+
+        /* skip the subtrees that cannot hold a match */
+        size_t skip = prune_length(pat, entry);
+        if (skip) {
+            i = index_bound(idx, i + 1, end, entry, skip, 1);
+            continue;
+        }
+        i++;
+    }
+    index_put(&v);
+
+    if (found > 0) {
+        struct stats_paused paused;
+        stats_pause(&paused);
+        found = 0;
+        for (size_t at = 0; at < matches_len; at += strlen(matches + at) + 1) {
+            found++;
+            if (cb(matches + at, arg) != 0) break;
+        }
+        stats_resume(&paused);
+    }
+    free(matches);
+    free(path);
+    free(pat);
+    return found;
+}
+
+/**
+ * Finds the entries whose path matches a pattern, in path order.
+ * The pattern is matched against whole paths, component by component:
+ *  - '*' matches any run of characters but '/', '?' any one character but '/',
+ *  - [abc], [a-z] match one character of a set, [!abc] or [^abc] one out of it,
+ *  - a component made of "**" alone matches any number of directories: "logs" then
+ *    "**" matches everything under logs/, "**" then "app.log" matches app.log at any depth,
+ *  - '\' makes the character after it match itself,
+ *  - a trailing '/' only matches directories.
+ * Directories are matched without their trailing slash, so "logs" matches "logs/".
+ * Each path is reported once, even if the archive holds several copies of it.
+ * The query runs on the index of the archive's entries the other queries share,
+ * built by the first of them and kept up to date as the archive grows.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ * @param pattern The pattern to match.
+ * @param cb Called with the path of each match (as stored in the archive) and arg.
+ *           Returning non-zero stops the search.
+ * @param arg Passed to cb.
+ *
+ * @return the number of entries matched (and reported to cb),
+ *         -1 in case of error.
+ */
+int tar_find(int tar_fd, const char *pattern, tar_find_cb cb, void *arg) {
+    if (!pattern || !cb) return -1;
+
+    struct tar_src src;
+    int ret = -1;
+    stats_begin(TAR_OP_FIND);
+    if (src_open(&src, tar_fd) == 0) ret = do_find(&src, pattern, cb, arg);
+    src_close(&src);
+    stats_end();
+    return ret;
+}
+
+/*
+ * Parallel loops. par_for() runs a function over the items 0..n, handed out one at
+ * a time to up to PAR_THREADS_MAX threads, the calling one included. Each thread
+ * counts its calls in its own call_stats, added to the caller's once they are
+ * done, so that the work shows up in the API call that asked for it.
+ */
+
+#define PAR_THREADS_MAX 16
+
+/* Runs item i. *local starts NULL in each thread, for state kept across its
+   items (released by the loop's release function). Returns 0, or -1 to stop. */
+typedef int (*par_fn)(void *arg, size_t i, void **local);
+
+struct par_loop {
+    size_t n;
+    par_fn fn;
+    void (*release)(void *local);
+    void *arg;
+    size_t next;                      /* next item, atomic */
+    int failed;                       /* atomic */
+    pthread_mutex_t lock;
+    struct call_stats counted;        /* what the threads counted, under lock */
+};
+
+static void *par_thread(void *arg) {
+    struct par_loop *l = arg;
+    struct call_stats outer = call;
+    void *local = NULL;
+    size_t i;
+
+    memset(&call, 0, sizeof(call));
+    while (!__atomic_load_n(&l->failed, __ATOMIC_RELAXED)
+           && (i = __atomic_fetch_add(&l->next, 1, __ATOMIC_RELAXED)) < l->n) {
+        if (l->fn(l->arg, i, &local) == -1) __atomic_store_n(&l->failed, 1, __ATOMIC_RELAXED);
+    }
+    if (local && l->release) l->release(local);
+
+    pthread_mutex_lock(&l->lock);
+    call_add(&l->counted, &call);
+    pthread_mutex_unlock(&l->lock);
+    call = outer;
+    return NULL;
+}
+
+/* Runs fn over the items 0..n on up to threads threads. Returns 0 on success,
+   -1 if fn failed for an item (the items not started yet are then skipped). */
+static int par_for(size_t n, size_t threads, par_fn fn, void (*release)(void *local), void *arg) {
+    struct par_loop l;
+    memset(&l, 0, sizeof(l));
+    l.n = n;
+    l.fn = fn;
+    l.release = release;
+    l.arg = arg;
+    pthread_mutex_init(&l.lock, NULL);
+
+    if (threads > PAR_THREADS_MAX) threads = PAR_THREADS_MAX;
+    pthread_t tids[PAR_THREADS_MAX - 1];
+    size_t started = 0;
+    while (started + 1 < threads && started + 1 < n && pthread_create(&tids[started], NULL, par_thread, &l) == 0)
+        started++;
+    par_thread(&l);
+    for (size_t i = 0; i < started; i++) pthread_join(tids[i], NULL);
+
+    call_add(&call, &l.counted);
+    pthread_mutex_destroy(&l.lock);
+    return l.failed ? -1 : 0;
+}
+
+/*
+ * Multi-archive views. A set of archives read as one namespace: a path is served
+ * by the first archive holding it in the override order, symlinks are followed
+ * across the archives, and a directory lists the children it has in any of them.
+ * The view references each archive's entry index, built in parallel when it is
+ * opened. A lookup looks at one archive at a time and copies out what it needs
+ * before moving on to the next, so that it never holds two index locks at once.
+ */
+
+#define MULTI_RECHECK_NS 1000000      /* how long the status of an archive is taken as is */
+
+/* An archive of a view, as found when the view was opened. */
+struct multi_shard {
+    int fd;
+    int gz;
+    uint64_t dev;
+    uint64_t ino;
+    struct tar_index *idx;
+    pthread_mutex_t lock;
+    struct stat st;                   /* as last checked, under lock */
+    int64_t checked;                  /* when, by now_ns(), under lock */
+};
+
+struct tar_multi {
+    size_t n;
+    int last_wins;
+    struct multi_shard *shards;       /* in override order */
+};
+
+/* What a lookup found: the archive serving the path (in override order), and
+   copies of the entry's record, path and link target. */
+struct multi_hit {
+    size_t shard;
+    off_t limit;                      /* the snapshot it was found in */
+    struct entry_rec rec;
+    char *path;
+    char *link;
+};
+
+struct multi_child {
+    char *path;
+    size_t shard;
+    uint32_t id;
+};
+
+/* Position in the caller's array of the i-th archive in override order. */
+static size_t multi_pos(const tar_multi_t *m, size_t i) {
+    return m->last_wins ? m->n - 1 - i : i;
+}
+
+/* The status of the archive, checked again if it is older than MULTI_RECHECK_NS or
+   the library wrote to the archive since. Returns 0 on success, -1 on error. */
+static int multi_stat(struct multi_shard *sh, struct stat *st) {
+    int64_t now = now_ns();
+    pthread_mutex_lock(&sh->lock);
+    int cached = now - sh->checked < MULTI_RECHECK_NS && !__atomic_load_n(&sh->idx->stale, __ATOMIC_ACQUIRE);
+    if (cached) *st = sh->st;
+    pthread_mutex_unlock(&sh->lock);
+    if (cached) return 0;
+
+    call.syscalls++;
+    if (fstat(sh->fd, st) == -1) return -1;
+    /* another file behind the descriptor: the index is not its own */
+    if ((uint64_t)st->st_dev != sh->dev || (uint64_t)st->st_ino != sh->ino) return -1;
+    pthread_mutex_lock(&sh->lock);
+    sh->st = *st;
+    sh->checked = now;
+    pthread_mutex_unlock(&sh->lock);
+    return 0;
+}
+
+/* Views the i-th archive of m for the call. While its index is up to date, this
+   costs no system call; the archive is only opened to bring the index up to date.
+   Returns 0 on success, -1 on error. */
+static int multi_view(tar_multi_t *m, size_t i, struct tar_src *src, struct index_view *v) {
+    struct multi_shard *sh = &m->shards[i];
+    struct stat st;
+    if (multi_stat(sh, &st) == -1) return -1;
+
+    if (src_open_known(src, sh->fd, end_lookup(&st), sh->gz) == 0) {
+        if (index_lock_fresh(sh->idx, src, &st, v) == 0 || index_lock(sh->idx, src, &st, v) == 0) return 0;
+    }
+    src_close(src);
+    return -1;
+}
+
+static void multi_unview(struct tar_src *src, struct index_view *v) {
+    index_unlock(v);
+    src_close(src);
+}
+
+static void hit_free(struct multi_hit *hit) {
+    free(hit->path);
+    free(hit->link);
+    hit->path = hit->link = NULL;
+}
+
+/* find_entry() across the archives of m: path is looked up in each in override
+   order, and a symlink it names with a trailing slash is followed from the first
+   archive again. Returns 1 with *hit set if found, 0 if not, -1 on error. */
+static int multi_find_hops(tar_multi_t *m, const char *path, struct multi_hit *hit, int hops) {
+    for (size_t i = 0; i < m->n; i++) {
+        struct tar_src src;
+        struct index_view v;
+        if (multi_view(m, i, &src, &v) == -1) return -1;
+
+        int r = v.idx->complete ? 0 : -1;
+        int follow = 0;
+        uint32_t id = find_record(&v, path);
+        if (id != NO_ENTRY) {
+            hit_free(hit);
+            hit->shard = i;
+            hit->limit = src.limit;
+            hit->rec = v.idx->recs[id];
+            hit->path = strdup(rec_path(v.idx, id));
+            hit->link = strdup(rec_link(v.idx, id));
+            follow = slashed_symlink(&v, id, path);
+            r = hit->path && hit->link ? 1 : -1;
+        }
+        multi_unview(&src, &v);
+        if (r == 0) continue;
+        if (r == -1 || !follow) return r;
+
+        if (hops == MAX_SYMLINK_HOPS) return -1;
+        call.symlink_hops++;
+
+        /* try resolving the symlink to its target entry, then with a trailing slash */
+        char *link = hit->link;
+        hit->link = NULL;
+        r = multi_find_hops(m, link, hit, hops + 1);
+        if (r == 0) {
+            char *target = with_slash(link);
+            r = target ? multi_find_hops(m, target, hit, hops + 1) : -1;
+            free(target);
+        }
+        free(link);
+        return r;
+    }
+    return 0;
+}
+
+/* resolve_entry() across the archives of m. */
+static int multi_resolve(tar_multi_t *m, const char *path, struct multi_hit *hit) {
+    int r = multi_find_hops(m, path, hit, 0);
+
+    for (int hops = 0; r == 1 && hit->rec.type == SYMTYPE; hops++) {
+        if (hops == MAX_SYMLINK_HOPS) return -1;
+        call.symlink_hops++;
+
+        char *target = hit->link;
+        hit->link = NULL;
+        r = multi_find_hops(m, target, hit, 0);
+        if (r == 0) {
+            /* directories are stored with a trailing slash */
+            char *dir = with_slash(target);
+            r = dir ? multi_find_hops(m, dir, hit, 0) : -1;
+            free(dir);
+        }
+        free(target);
+    }
+    return r;
+}
+
+/* Indexes the i-th archive of the view arg, and finds out whether it is compressed. */
+static int multi_build_one(void *arg, size_t i, void **local) {
+    struct multi_shard *sh = &((tar_multi_t *)arg)->shards[i];
+    struct tar_src src;
+    struct index_view v;
+    struct stat st;
+    int r = -1;
+    (void)local;
+
+    if (src_open(&src, sh->fd) == 0) {
+        sh->gz = src.gz != NULL;
+        if (multi_stat(sh, &st) == 0 && index_lock(sh->idx, &src, &st, &v) == 0) {
+            index_unlock(&v);
+            r = 0;
+        }
+    }
+    src_close(&src);
+    return r;
+}
+
+/* Indexes the archives of m, PAR_THREADS_MAX at once. Returns 0 on success, -1 on error. */
+static int multi_build(tar_multi_t *m) {
+    return par_for(m->n, PAR_THREADS_MAX, multi_build_one, NULL, m);
+}
+
+/**
+ * Opens a set of archives as a single namespace.
+ * A path is served by the first archive that holds it in the override order: fds[0]
+ * first, or fds[n - 1] first with TAR_MULTI_LAST_WINS. A symlink may point into
+ * another archive of the set. The index of each archive is built (or taken from the
+ * library's cache) in parallel, and kept until the view is closed. A lookup checks
+ * the archives' status at most once a millisecond: writes made through this library
+ * are seen at once, those of other processes within a millisecond.
+ *
+ * @param fds File descriptors pointing to the start of valid tar archive files.
+ *            They must stay open while the view is.
+ * @param n The number of archives.
+ * @param flags 0, or TAR_MULTI_LAST_WINS.
+ *
+ * @return the view, or NULL in case of error.
+ */
+tar_multi_t *tar_multi_open(const int *fds, size_t n, int flags) {
+    if (!fds || n == 0 || (flags & ~TAR_MULTI_LAST_WINS)) return NULL;
+
+    stats_begin(TAR_OP_MULTI_OPEN);
+    tar_multi_t *m = calloc(1, sizeof(*m));
+    if (!m) goto fail;
+    m->n = n;
+    m->last_wins = (flags & TAR_MULTI_LAST_WINS) != 0;
+    m->shards = calloc(n, sizeof(*m->shards));
+    if (!m->shards) goto fail;
+
+    for (size_t i = 0; i < n; i++) {
+        struct multi_shard *sh = &m->shards[i];
+        struct stat st;
+        sh->fd = fds[multi_pos(m, i)];
+        call.syscalls++;
+        if (fstat(sh->fd, &st) == -1) goto fail;
+        sh->dev = st.st_dev;
+        sh->ino = st.st_ino;
+        sh->checked = INT64_MIN / 2;   /* never */
+        /* the view holds its indexes: they stay out of the cache of the single-archive calls */
+        if (!(sh->idx = index_acquire(&st, 0))) goto fail;
+        pthread_mutex_init(&sh->lock, NULL);
+    }
+    if (multi_build(m) == -1) goto fail;
+
+    stats_end();
+    return m;
+
+fail:
+    tar_multi_close(m);
+    stats_end();
+    return NULL;
+}
+
+/**
+ * Checks whether an entry exists in any archive of a view.
+ *
+ * @param m A view returned by tar_multi_open().
+ * @param path A path to an entry.
+ *
+ * @return the position in fds, from 1, of the archive serving the entry,
+ *         zero if no archive holds an entry at the given path,
+ *         -1 in case of error.
+ */
+int tar_multi_exists(tar_multi_t *m, const char *path) {
+    if (!m || !path) return -1;
+
+    int ret = 0;
+    stats_begin(TAR_OP_MULTI_EXISTS);
+    for (size_t i = 0; i < m->n && ret == 0; i++) {
+        struct tar_src src;
+        struct index_view v;
+        if (multi_view(m, i, &src, &v) == -1) {
+            ret = -1;
+            break;
+        }
+        ret = do_exists(&v, path);
+        if (ret == 1) ret = (int)multi_pos(m, i) + 1;
+        multi_unview(&src, &v);
+    }
+    stats_end();
+    return ret;
+}
+
+/* Type of the entry serving path in m, for the is_* functions. Returns 1 with
+   *type set if found, 0 if not, -1 on error. */
+static int multi_lookup(tar_multi_t *m, const char *path, int op, char *type) {
+    if (!m || !path) return -1;
+
+    struct multi_hit hit;
+    memset(&hit, 0, sizeof(hit));
+    stats_begin(op);
+    int r = multi_find_hops(m, path, &hit, 0);
+    stats_end();
+    *type = hit.rec.type;
+    hit_free(&hit);
+    return r;
+}
+
+/**
+ * Checks whether the entry serving a path in a view is a directory.
+ *
+ * @param m A view returned by tar_multi_open().
+ * @param path A path to an entry.
+ *
+ * @return zero if no archive holds an entry at the given path or the entry is not a directory,
+ *         any other value otherwise.
+ */
+int tar_multi_is_dir(tar_multi_t *m, const char *path) {
+    char type;
+    return multi_lookup(m, path, TAR_OP_MULTI_IS_DIR, &type) == 1 && type == DIRTYPE;
+}
+
+/**
+ * Checks whether the entry serving a path in a view is a file.
+ *
+ * @param m A view returned by tar_multi_open().
+ * @param path A path to an entry.
+ *
+ * @return zero if no archive holds an entry at the given path or the entry is not a file,
+ *         any other value otherwise.
+ */
+int tar_multi_is_file(tar_multi_t *m, const char *path) {
+    char type;
+    return multi_lookup(m, path, TAR_OP_MULTI_IS_FILE, &type) == 1 && (type == REGTYPE || type == AREGTYPE);
+}
+
+/**
+ * Checks whether the entry serving a path in a view is a symlink.
+ *
+ * @param m A view returned by tar_multi_open().
+ * @param path A path to an entry.
+ *
+ * @return zero if no archive holds an entry at the given path or the entry is not a symlink,
+ *         any other value otherwise.
+ */
+int tar_multi_is_symlink(tar_multi_t *m, const char *path) {
+    char type;
+    return multi_lookup(m, path, TAR_OP_MULTI_IS_SYMLINK, &type) == 1 && type == SYMTYPE;
+}
+
+/* Length of a child's name: its path without the trailing slash of a directory. */
+static size_t child_name_len(const char *path) {
+    size_t len = strlen(path);
+    return len && path[len - 1] == '/' ? len - 1 : len;
+}
+
+/* Children by name, then override order. */
+static int cmp_child_names(const void *a, const void *b) {
+    const struct multi_child *x = a, *y = b;
+    size_t lx = child_name_len(x->path), ly = child_name_len(y->path);
+    int c = memcmp(x->path, y->path, lx < ly ? lx : ly);
+    if (c) return c;
+    if (lx != ly) return lx < ly ? -1 : 1;
+    return (x->shard > y->shard) - (x->shard < y->shard);
+}
+
+/* Children in override order, then archive order. */
+static int cmp_child_order(const void *a, const void *b) {
+    const struct multi_child *x = a, *y = b;
+    if (x->shard != y->shard) return x->shard < y->shard ? -1 : 1;
+    return (x->id > y->id) - (x->id < y->id);
+}
+
+static int do_multi_list(tar_multi_t *m, const char *path, char **entries, size_t *no_entries) {
+    char *list_path = NULL;   // directory listed, with a trailing slash
+
+    if (path != NULL && strcmp(path, "") != 0) {
+        struct multi_hit hit;
+        memset(&hit, 0, sizeof(hit));
+        int r = multi_resolve(m, path, &hit);
+        if (r == 1 && hit.rec.type == DIRTYPE) {
+            size_t len = strlen(hit.path);
+            list_path = (len && hit.path[len - 1] == '/') ? strdup(hit.path) : with_slash(hit.path);
+            if (!list_path) r = -1;
+        }
+        hit_free(&hit);
+        if (r == -1) return -1;
+        if (!list_path) {
+            *no_entries = 0;
+            return 0;
+        }
+    }
+
+    /* the children the directory has in each archive */
+    struct multi_child *children = NULL;
+    size_t count = 0, cap = 0;
+    int ret = 1, partial = 0;
+    for (size_t i = 0; i < m->n && ret == 1; i++) {
+        struct tar_src src;
+        struct index_view v;
+        uint32_t *ids = NULL;
+        size_t n = 0;
+        if (multi_view(m, i, &src, &v) == -1) {
+            ret = -1;
+            break;
+        }
+        if (list_children(&v, list_path ? list_path : "", &ids, &n) == -1) ret = -1;
+        for (size_t k = 0; ret == 1 && k < n; k++) {
+            if (count == cap) {
+                size_t grown_cap = cap ? 2 * cap : 64;
+                struct multi_child *grown = realloc(children, grown_cap * sizeof(*grown));
+                if (!grown) {
+                    ret = -1;
+                    break;
+                }
+                children = grown;
+                cap = grown_cap;
+            }
+            children[count].path = strdup(rec_path(v.idx, ids[k]));
+            children[count].shard = i;
+            children[count].id = ids[k];
+            if (!children[count++].path) ret = -1;
+        }
+        free(ids);
+        partial |= !v.idx->complete;
+        multi_unview(&src, &v);
+    }
+    free(list_path);
+
+    /* one child per name, from the first archive holding it, listed in override order */
+    size_t kept = 0;
+    if (ret == 1) {
+        if (count) qsort(children, count, sizeof(*children), cmp_child_names);
+        for (size_t k = 0; k < count; k++) {
+            if (kept && child_name_len(children[k].path) == child_name_len(children[kept - 1].path)
+                && memcmp(children[k].path, children[kept - 1].path, child_name_len(children[k].path)) == 0) {
+                free(children[k].path);
+                continue;
+            }
+            children[kept++] = children[k];
+        }
+        count = kept;
+        if (kept) qsort(children, kept, sizeof(*children), cmp_child_order);
+
+        kept = kept < *no_entries ? kept : *no_entries;
+        for (size_t k = 0; ret == 1 && k < kept; k++) {
+            size_t len = strlen(children[k].path) + 1;
+            if (len > TAR_PATH_MAX) ret = -1;
+            else memcpy(entries[k], children[k].path, len);
+        }
+        // an index cut short by a corrupt header may miss some
+        if (kept < *no_entries && partial) ret = -1;
+    }
+    for (size_t k = 0; k < count; k++) free(children[k].path);
+    free(children);
+
+    *no_entries = kept;
+    return ret;
+}
+
+/**
+ * Lists the entries at a given path in a view, merged across its archives.
+ * The directory is the one serving the path; its entries are listed from every
+ * archive, each name once (the entry of the first archive holding it in the
+ * override order), in override order then archive order.
+ *
+ * @param m A view returned by tar_multi_open().
+ * @param path A path to a directory, NULL for the root. Symlinks are resolved.
+ * @param entries An array of char arrays of TAR_PATH_MAX bytes each; a longer entry path makes the call fail.
+ * @param no_entries An in-out argument.
+ *                   The caller set it to the number of entries in `entries`.
+ *                   The callee set it to the number of entries listed.
+ *
+ * @return zero if no directory serves the given path,
+ *         1 in case of success,
+ *         -1 in case of error.
+ */
+int tar_multi_list(tar_multi_t *m, const char *path, char **entries, size_t *no_entries) {
+    if (!m || !entries || !no_entries) return -1;
+
+    stats_begin(TAR_OP_MULTI_LIST);
+    int ret = do_multi_list(m, path, entries, no_entries);
+    stats_end();
+    return ret;
+}
+
+/**
+ * Reads the file serving a path in a view.
+ *
+ * @param m A view returned by tar_multi_open().
+ * @param path A path to a file. Symlinks are resolved.
+ * @param offset An offset in the file from which to start reading from.
+ * @param dest A destination buffer to read the given file into.
+ * @param len An in-out argument.
+ *            The caller set it to the size of dest.
+ *            The callee set it to the number of bytes written to dest.
+ *
+ * @return as read_file() does.
+ */
+ssize_t tar_multi_read_file(tar_multi_t *m, const char *path, size_t offset, uint8_t *dest, size_t *len) {
+    if (!m || !path || !dest || !len) return -1;
+
+    struct multi_hit hit;
+    memset(&hit, 0, sizeof(hit));
+    ssize_t ret = -1;
+    stats_begin(TAR_OP_MULTI_READ_FILE);
+    if (multi_resolve(m, path, &hit) == 1 && (hit.rec.type == REGTYPE || hit.rec.type == AREGTYPE)) {
+        struct tar_src src;
+        const struct multi_shard *sh = &m->shards[hit.shard];
+        if (src_open_known(&src, sh->fd, hit.limit, sh->gz) == 0) ret = read_rec(&src, &hit.rec, offset, dest, len);
+        src_close(&src);
+    }
+    stats_end();
+    hit_free(&hit);
+    return ret;
+}
+
+/**
+ * Closes a view. The archives' file descriptors are left open.
+ *
+ * @param m A view returned by tar_multi_open(), or NULL.
+ */
+void tar_multi_close(tar_multi_t *m) {
+    if (!m) return;
+    for (size_t i = 0; m->shards && i < m->n; i++) {
+        if (!m->shards[i].idx) continue;
+        index_release(m->shards[i].idx);
+        pthread_mutex_destroy(&m->shards[i].lock);
+    }
+    free(m->shards);
+    free(m);
+}
+
+/*
+ * Durable appends.
+ *
+ * An append is written data first: the entry's data, the headers of the
+ * entries after it and the new end-of-archive blocks go beyond the current end,
+ * and only then the first header is written over the first zero block closing
+ * the archive. That single block write is the commit point: until it lands the
+ * archive still ends where it did, and whatever was written after it is a torn
+ * tail that recover() truncates.
+ *
+ * A tar_appender makes this durable with group commit: appends arriving while a
+ * batch is being written queue up and go together in the next batch, which costs
+ * two fdatasync() (data, then the committing header) whatever its size.
+ */
+
+#define NAME_SET_MIN 64
+#define APPEND_IOV 1024           /* iovecs per pwritev(), the Linux limit */
+
+struct append_req {
+    tar_header_t h;
+    const char *name;
+    const uint8_t *data;
+    size_t len;
+    int ret;
+    int done;
+    struct append_req *next;
+};
+
+/* Set of the paths in the archive (open addressing, linear probing). */
+struct name_set {
+    char **slots;
+    size_t cap;
+    size_t used;          /* live entries and tombstones */
+};
+
+static char name_tombstone;
+
+struct tar_appender {
+    int fd;
+    unsigned int window_us;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    off_t end;                    /* committed end of the archive */
+    int committing;               /* a batch is being written */
+    struct append_req *queue;     /* next batch */
+    struct append_req **queue_tail;
+    struct name_set names;
+    struct end_slot *slot;        /* where readers find the committed end */
+    uint64_t dev;
+    uint64_t ino;
+};
+
+static const uint8_t zero_blocks[2 * BLOCKSIZE];
+
+/* Whether filename fits the name field of a header: we write no extension header,
+   and a truncated name could make two appends with distinct names collide. */
+static int name_fits(const char *filename) {
+    return strlen(filename) <= sizeof(((tar_header_t *)0)->name);
+}
+
+static void make_header(tar_header_t *h, const char *filename, size_t len) {
+    memset(h, 0, sizeof(*h));
+
+    // name (not null-terminated when it fills the field), see name_fits()
+    memcpy(h->name, filename, strlen(filename));
+
+    // size (octal)
+    snprintf(h->size, sizeof(h->size), "%011o", (unsigned int)len);
+
+    // type, magic et version
+    h->typeflag = REGTYPE;
+    memcpy(h->magic, TMAGIC, TMAGLEN);
+    memcpy(h->version, TVERSION, TVERSLEN);
+
+    // checksum: fill with spaces first
+    memset(h->chksum, ' ', sizeof(h->chksum));
+    unsigned int cksum = compute_checksum(h);
+    snprintf(h->chksum, sizeof(h->chksum), "%06o", cksum);
+    h->chksum[6] = '\0';
+    h->chksum[7] = ' ';
+}
+
+static int pwrite_all(int fd, const void *buf, size_t len, off_t off) {
+    size_t done = 0;
+    while (done < len) {
+        call.syscalls++;
+        ssize_t w = pwrite(fd, (const uint8_t *)buf + done, len - done, off + (off_t)done);
+        if (w < 0) return -1;
+        done += (size_t)w;
+    }
+    return 0;
+}
+
+/* Appends the entries of batch at end, data first and the first header last
+   (see above). With sync, each of the two steps is made durable before going on.
+   On failure the archive is put back to ending at end. */
+static int append_entries(int fd, off_t end, struct append_req *batch, int sync, off_t *new_end) {
+    struct iovec iov[APPEND_IOV];
+    int n = 0;
+    off_t pos = end + BLOCKSIZE;      /* where iov starts */
+    off_t off = pos;                  /* where the next byte of iov goes */
+
+    for (struct append_req *r = batch; r; r = r->next) {
+        if (r != batch) {
+            iov[n].iov_base = &r->h;
+            iov[n++].iov_len = BLOCKSIZE;
+        }
+        if (r->len) {
+            iov[n].iov_base = (void *)r->data;
+            iov[n++].iov_len = r->len;
+        }
+        size_t padding = round_up_512(r->len) - r->len;
+        if (padding) {
+            iov[n].iov_base = (void *)zero_blocks;
+            iov[n++].iov_len = padding;
+        }
+        off += (r != batch ? BLOCKSIZE : 0) + round_up_512(r->len);
+
+        /* flush when the next entry (up to 3 iovecs) plus the trailer might not fit */
+        if (n > APPEND_IOV - 4 || !r->next) {
+            if (!r->next) {
+                iov[n].iov_base = (void *)zero_blocks;
+                iov[n++].iov_len = sizeof(zero_blocks);
+                off += sizeof(zero_blocks);
+            }
+            for (int i = 0; i < n;) {
+                call.syscalls++;
+                ssize_t w = pwritev(fd, iov + i, n - i, pos);
+                if (w < 0) goto fail;
+                pos += w;
+                while (i < n && (size_t)w >= iov[i].iov_len) w -= iov[i++].iov_len;
+                if (i < n) {
+                    iov[i].iov_base = (uint8_t *)iov[i].iov_base + w;
+                    iov[i].iov_len -= (size_t)w;
+                }
+            }
+            n = 0;
+        }
+    }
+
+    call.syscalls += sync ? 2 : 0;
+    if (sync && fdatasync(fd) == -1) goto fail;
+    if (pwrite_all(fd, &batch->h, BLOCKSIZE, end) == -1) goto fail;
+    if (sync && fdatasync(fd) == -1) goto fail;
+
+    index_stale(fd);
+    if (new_end) *new_end = off - sizeof(zero_blocks);
+    return 0;
+
+fail:
+    pwrite_all(fd, zero_blocks, sizeof(zero_blocks), end);
+    index_stale(fd);
+    if (ftruncate(fd, end + sizeof(zero_blocks)) == -1) return -1;
+    if (sync) fdatasync(fd);
+    return -1;
+}
+
+static uint64_t hash_path(const char *p) {
+    uint64_t h = 1469598103934665603ULL;   /* FNV-1a */
+    while (*p) h = (h ^ (uint8_t)*p++) * 1099511628211ULL;
+    return h;
+}
+
+/* Index of name in the set, or of the slot where it would go. */
+static size_t set_slot(const struct name_set *s, const char *name) {
+    size_t i = hash_path(name) & (s->cap - 1);
+    size_t free_slot = s->cap;
+    while (s->slots[i]) {
+        if (s->slots[i] == &name_tombstone) {
+            if (free_slot == s->cap) free_slot = i;
+        } else if (strcmp(s->slots[i], name) == 0) {
+            return i;
+        }
+        i = (i + 1) & (s->cap - 1);
+    }
+    return free_slot != s->cap ? free_slot : i;
+}
+
+/* Returns 1 if name was added, 0 if it was already there, -1 on error. */
+static int set_add(struct name_set *s, const char *name) {
+    if (4 * (s->used + 1) > 3 * s->cap) {
+        struct name_set grown = { NULL, s->cap ? 2 * s->cap : NAME_SET_MIN, 0 };
+        grown.slots = calloc(grown.cap, sizeof(char *));
+        if (!grown.slots) return -1;
+        for (size_t i = 0; i < s->cap; i++) {
+            if (s->slots[i] && s->slots[i] != &name_tombstone) {
+                grown.slots[set_slot(&grown, s->slots[i])] = s->slots[i];
+                grown.used++;
+            }
+        }
+        free(s->slots);
+        *s = grown;
+    }
+
+    size_t i = set_slot(s, name);
+    if (s->slots[i] && s->slots[i] != &name_tombstone) return 0;
+    char *copy = strdup(name);
+    if (!copy) return -1;
+    if (!s->slots[i]) s->used++;
+    s->slots[i] = copy;
+    return 1;
+}
+
+static void set_remove(struct name_set *s, const char *name) {
+    if (!s->cap) return;
+    size_t i = set_slot(s, name);
+    if (s->slots[i] && s->slots[i] != &name_tombstone) {
+        free(s->slots[i]);
+        s->slots[i] = &name_tombstone;
+    }
+}
+
+static void set_free(struct name_set *s) {
+    for (size_t i = 0; i < s->cap; i++) {
+        if (s->slots[i] != &name_tombstone) free(s->slots[i]);
+    }
+    free(s->slots);
+    s->slots = NULL;
+    s->cap = s->used = 0;
+}
+
+/* Walks the archive up to its end, truncating a torn tail left by an append
+   that did not commit: an entry cut short by the end of the file, or anything
+   but zeros after the first zero block. The paths met are added to names if
+   given. Returns 1 if the tail was repaired, 0 if it was intact, -1 on error. */
+static int recover(int fd, off_t *end_out, struct name_set *names) {
+    struct tar_src src;
+    struct stat st;
+    call.syscalls++;
+    if (fstat(fd, &st) == -1 || src_open(&src, fd) == -1) return -1;
+    if (src.gz) {
+        src_close(&src);
+        return -1;
+    }
+    struct tar_scan sc;
+    off_t pos;
+    int ret = -1;
+
+    scan_begin(&sc, &src, SCAN_CHECKSUM);
+    while (1) {
+        int r = scan_next(&sc);
+        if (r == 0) {
+            pos = sc.pos;
+            break;
+        }
+        /* the committing header is written in one block, a bad one is not ours to fix */
+        if (r == -1 && sc.err != SCAN_TRUNCATED) goto out;
+
+        /* an entry whose headers or data are cut short by the end of the file */
+        if (r == -1 || sc.e.data + round_up_512(sc.e.size) > st.st_size) {
+            pos = sc.e.start;
+            break;
+        }
+        if (names && set_add(names, sc.e.path) == -1) goto out;
+    }
+
+    /* everything from pos on must be zeros, at least two blocks of them */
+    int torn = st.st_size < pos + (off_t)sizeof(zero_blocks);
+    uint8_t buf[16 * BLOCKSIZE];
+    for (off_t o = pos; !torn && o < st.st_size; o += sizeof(buf)) {
+        size_t n = st.st_size - o < (off_t)sizeof(buf) ? (size_t)(st.st_size - o) : sizeof(buf);
+        if (src_pread(&src, buf, n, o) != (ssize_t)n) goto out;
+        for (size_t i = 0; i < n; i++) {
+            if (buf[i]) {
+                torn = 1;
+                break;
+            }
+        }
+    }
+
+    ret = 0;
+    if (torn) {
+        call.syscalls += 2;
+        if (pwrite_all(fd, zero_blocks, sizeof(zero_blocks), pos) == -1
+            || ftruncate(fd, pos + sizeof(zero_blocks)) == -1 || fdatasync(fd) == -1) {
+            ret = -1;
+            goto out;
+        }
+        index_stale(fd);
+        ret = 1;
+    }
+    if (end_out) *end_out = pos;
+
+out:
+    scan_end(&sc);
+    src_close(&src);
+    return ret;
+}
+
+/* Finds the end of the archive: the offset of the first of the two zero blocks
+   closing it. Returns 0 on success, -1 on error. */
+static int archive_end(struct tar_src *src, off_t *end) {
+    struct tar_scan sc;
+    int r;
+
+    scan_begin(&sc, src, 0);
+    while ((r = scan_next(&sc)) != -1) {
+        if (r == 1) continue;
+
+        tar_header_t h2;
+        ssize_t r2 = src_pread(src, &h2, sizeof(h2), sc.pos + BLOCKSIZE);
+        if (r2 != (ssize_t)sizeof(h2)) {
+            r = -1;
+            break;
+        }
+        if (is_zero_block((const uint8_t *)&h2)) {
+            /* two consecutive zero blocks -> end is the start of the first one */
+            *end = sc.pos;
+            r = 0;
+            break;
+        }
+        /* false alarm: the next scan starts with h2 */
+        sc.pos += BLOCKSIZE;
+    }
+    scan_end(&sc);
+    return r;
+}
+
+static int do_add_file(int tar_fd, char *filename, uint8_t *src, size_t len) {
+
+    if (!filename || !src || !name_fits(filename)) return -2;
+
+
+    // if entry already exists -> error
+    if (exists(tar_fd, filename)) {
+        perror("add_file () : file already exists");
+        return -1;
+    }
+
+
+    // find end of archive (first zero block), compressed archives are read-only
+    struct tar_src archive;
+    if (src_open(&archive, tar_fd) == -1) return -2;
+    off_t end = -1;
+    if (!archive.gz) {
+        /* the index knows it, when it covers the whole archive and two zero blocks are there */
+        struct index_view v;
+        if (index_get(&archive, &v) == 0) {
+            tar_header_t h2;
+            if (v.idx->complete && v.n == v.idx->n
+                && src_pread(&archive, &h2, sizeof(h2), v.idx->end + BLOCKSIZE) == (ssize_t)sizeof(h2)
+                && is_zero_block((const uint8_t *)&h2))
+                end = v.idx->end;
+            index_put(&v);
+        }
+        if (end == -1 && archive_end(&archive, &end) == -1) end = -1;
+    }
+    src_close(&archive);
+    if (end == -1) return -2;
+
+    struct append_req req;
+    memset(&req, 0, sizeof(req));
+    make_header(&req.h, filename, len);
+    req.data = src;
+    req.len = len;
+
+    return append_entries(tar_fd, end, &req, 0, NULL) == -1 ? -2 : 0;
+}
+
+/**
+ * Adds a file at the end of the archive, at the archive's root level.
+ * The archive's metadata must be updated accordingly.
+ * For the file header, only the name, size, typeflag, magic value (to "ustar"), version value (to "00") and checksum fields need to be correctly set.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ * @param filename The name of the file to add. If an entry already exists with the same name, the file is not written, and the function returns -1.
+ * @param src A source buffer containing the file content to add.
+ * @param len The length of the source buffer.
+ *
+ * @return 0 if the file was added successfully,
+ *         -1 if the archive already contains an entry at the given path,
+ *         -2 if an error occurred (or the archive is compressed, or the name is longer than the 100 bytes of a header's name field)
+ */
+int add_file(int tar_fd, char *filename, uint8_t *src, size_t len) {
+    stats_begin(TAR_OP_ADD_FILE);
+    int ret = do_add_file(tar_fd, filename, src, len);
+    stats_end();
+    return ret;
+}
+
+
+/**
+ * Repairs an archive left torn by an append that did not complete: an entry cut short
+ * by the end of the file, or data after the first zero block closing the archive.
+ * The archive is truncated back to its last complete entry and closed again with two zero blocks.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a tar archive file, open for writing.
+ *
+ * @return 0 if the archive was intact,
+ *         1 if a torn tail was truncated,
+ *         -1 in case of error (including a header with an invalid checksum, which is left untouched).
+ */
+int tar_recover(int tar_fd) {
+    stats_begin(TAR_OP_RECOVER);
+    int ret = recover(tar_fd, NULL, NULL);
+    stats_end();
+    return ret;
+}
+
+/**
+ * Opens a durable appender on an archive, after repairing it with tar_recover().
+ * Appends made through it are written data first and committed by a single header
+ * write, then made durable with group commit: the appends of all the threads using
+ * the appender that arrive while a batch is written go together in the next batch,
+ * for two fdatasync() per batch.
+ * Meanwhile, the other functions of this library called in the same process, through any
+ * file descriptor on the archive, read it as it was at the last commit before they started:
+ * they never see a partially written append, nor wait for one in progress. After each
+ * commit though, the first call to find the archive grown brings its entry index up to
+ * date under an exclusive lock, and the calls on the archive that start meanwhile wait
+ * for that rescan of the new entries.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a tar archive file, open for writing.
+ *               It must stay open and only be appended to through the appender until it is closed.
+ * @param commit_window_us How long, in microseconds, the first append of a batch waits for others
+ *                         to join it before writing. Zero only batches appends that arrive while
+ *                         the previous batch is being written.
+ *
+ * @return the appender, or NULL in case of error (including a compressed archive,
+ *         or an archive that already has an appender).
+ */
+tar_appender_t *tar_appender_open(int tar_fd, unsigned int commit_window_us) {
+    tar_appender_t *a = calloc(1, sizeof(*a));
+    struct stat st;
+    if (!a) return NULL;
+
+    if (fstat(tar_fd, &st) == -1 || recover(tar_fd, &a->end, &a->names) == -1
+        || !(a->slot = end_claim(st.st_dev, st.st_ino, a->end))) {
+        set_free(&a->names);
+        free(a);
+        return NULL;
+    }
+    a->dev = st.st_dev;
+    a->ino = st.st_ino;
+    a->fd = tar_fd;
+    a->window_us = commit_window_us;
+    a->queue_tail = &a->queue;
+    pthread_mutex_init(&a->lock, NULL);
+    pthread_cond_init(&a->cond, NULL);
+    return a;
+}
+
+static int do_append(tar_appender_t *a, char *filename, uint8_t *src, size_t len) {
+    if (!a || !filename || !src || !name_fits(filename)) return -2;
+
+    struct append_req req;
+    memset(&req, 0, sizeof(req));
+    make_header(&req.h, filename, len);
+    req.name = filename;
+    req.data = src;
+    req.len = len;
+
+    pthread_mutex_lock(&a->lock);
+
+    int added = set_add(&a->names, filename);
+    if (added != 1) {
+        pthread_mutex_unlock(&a->lock);
+        return added == 0 ? -1 : -2;
+    }
+    *a->queue_tail = &req;
+    a->queue_tail = &req.next;
+
+    while (!req.done) {
+        if (a->committing) {
+            pthread_cond_wait(&a->cond, &a->lock);
+            continue;
+        }
+
+        /* lead the next batch */
+        a->committing = 1;
+        if (a->window_us) {
+            pthread_mutex_unlock(&a->lock);
+            usleep(a->window_us);
+            pthread_mutex_lock(&a->lock);
+        }
+        struct append_req *batch = a->queue;
+        a->queue = NULL;
+        a->queue_tail = &a->queue;
+        off_t end = a->end;
+        pthread_mutex_unlock(&a->lock);
+
+        off_t new_end;
+        int ret = append_entries(a->fd, end, batch, 1, &new_end) == -1 ? -2 : 0;
+
+        pthread_mutex_lock(&a->lock);
+        if (ret == 0) {
+            a->end = new_end;
+            end_publish(a->slot, a->dev, a->ino, new_end);
+        }
+        for (struct append_req *r = batch; r; r = r->next) {
+            if (ret != 0) set_remove(&a->names, r->name);
+            r->ret = ret;
+            r->done = 1;
+        }
+        a->committing = 0;
+        pthread_cond_broadcast(&a->cond);
+    }
+
+    pthread_mutex_unlock(&a->lock);
+    return req.ret;
+}
+
+/**
+ * Adds a file at the end of the archive, at the archive's root level, and returns once it is durable.
+ * The header is set like add_file() does. Safe to call from several threads at once.
+ *
+ * @param a An appender returned by tar_appender_open().
+ * @param filename The name of the file to add. If an entry already exists with the same name, the file is not written, and the function returns -1.
+ * @param src A source buffer containing the file content to add.
+ * @param len The length of the source buffer.
+ *
+ * @return 0 if the file was added and synced to disk,
+ *         -1 if the archive already contains an entry at the given path,
+ *         -2 if an error occurred (or the name is longer than the 100 bytes of a header's name field)
+ */
+int tar_append(tar_appender_t *a, char *filename, uint8_t *src, size_t len) {
+    stats_begin(TAR_OP_APPEND);
+    int ret = do_append(a, filename, src, len);
+    stats_end();
+    return ret;
+}
+
+/**
+ * Closes an appender. Appends still in progress must have returned.
+ *
+ * @param a An appender returned by tar_appender_open(), or NULL.
+ */
+void tar_appender_close(tar_appender_t *a) {
+    if (!a) return;
+    end_release(a->slot);
+    set_free(&a->names);
+    pthread_mutex_destroy(&a->lock);
+    pthread_cond_destroy(&a->cond);
+    free(a);
+}
+
+/*
+ * Archive diff. tar_diff() walks the by_path orders of both indexes side by side,
+ * so that each path is looked at once, and compares the last copy of each path,
+ * the one tar leaves on disk when it extracts an archive grown with -r or -u
+ * (the other functions see the first copy). The differences are gathered under
+ * the index locks. With TAR_DIFF_CONTENT, files whose headers match are only
+ * noted there, and their data compared once both locks are dropped, so that the
+ * reads do not hold up the updates of either index. The callback runs and the
+ * delta archive is written after.
+ */
 
-    while (1) {
-        ssize_t r = read(tar_fd, &h, sizeof(h));
-        if (r != (ssize_t)sizeof(h)) return -1;
-
-        if (is_zero_block((const uint8_t *)&h)) return 0;
-
-        if (header_path(&h, fullpath) == -1) return -1;
-
-        // if path + "/" is equal to fullpath, we might have found a symlink directory
-        // so we check if h is a symlink and if so, we resolve it to its target
-        size_t flen = strlen(fullpath);
-        if (flen + 1 < PATHBUF) {
-            char fullpath_slash[PATHBUF];
-            memcpy(fullpath_slash, fullpath, flen);
-            fullpath_slash[flen] = '/';
-            fullpath_slash[flen + 1] = '\0';
-
-            //printf("comparing with symlink dir: %s\n", fullpath_slash);
-            //printf("comparing with dir: %s\n", path);
-
-            if (strcmp(fullpath_slash, path) == 0) {
-                //printf("passes\n");
-                if (h.typeflag == SYMTYPE) {
-                    //printf("passes2\n");
-                    /* copy and null-terminate link target safely */
-                    char link_target[PATHBUF];
-                    size_t ln_sz = sizeof(h.linkname);
-                    size_t cp = ln_sz < (PATHBUF - 1) ? ln_sz : (PATHBUF - 1);
-                    memcpy(link_target, h.linkname, cp);
-                    link_target[cp] = '\0';
-
-                    /* try resolving the symlink to its target entry */
-                    int res = find_entry(tar_fd, link_target, out);
-                    //printf("passes2bis\n");
-                    if (res == 1) return 1;
-                    if (res == -1) return -1;
-
-                    /* if direct target not found, try appending a trailing slash to the link target */
-                    size_t lt_len = strlen(link_target);
-                    if (lt_len + 1 < PATHBUF) {
-                        //printf("passes3\n");
-                        link_target[lt_len] = '/';
-                        link_target[lt_len + 1] = '\0';
-                        res = find_entry(tar_fd, link_target, out);
-                        //printf("res after adding slash: %d\n", res);
-                        //printf("out path after adding slash: ");
-                        /*
-                        if (res == 1 && out) {
-                            char out_path[PATHBUF];
-                            header_path(out, out_path);
-                            printf("%s\n", out_path); // works well, finds the correct path for the symlink target
-                        }
-                        */
-                        //printf("before return after adding slash\n");
-                        return res;
-                    }
-                    //printf("passes4\n");
-                    return 0;
-                } else {
-                    //printf("passes5\n");
-                    /* header represents the directory (with trailing slash in comparison) */
-                    if (out) *out = h;
-                    return 1;
-                }
-            }
-        }
+#define DIFF_CHUNK (1L << 20)         /* bytes compared or copied at once */
+#define DIFF_PENDING 0                /* same headers, the data is still to compare */
 
+struct diff_item {
+    size_t path;                      /* offset in diff_list.paths */
+    int change;                       /* TAR_DIFF_*, or DIFF_PENDING */
+    off_t start;                      /* the entry in the new archive, headers included */
+    off_t len;
+    off_t data;                       /* its data */
+    off_t size;
+    off_t old_data;                   /* the data of the old copy, if DIFF_PENDING */
+};
 
-        if (strcmp(fullpath, path) == 0) {
-            if (out) *out = h;
-            return 1;
-        }
+struct diff_list {
+    struct diff_item *items;
+    size_t n;
+    size_t cap;
+    char *paths;
+    size_t paths_len;
+    size_t paths_cap;
+    uint8_t *buf;                     /* 2 * DIFF_CHUNK, to compare data */
+};
 
-        off_t size = (off_t)TAR_INT(h.size);
-        off_t skip = round_up_512(size);
-        if (skip > 0 && lseek(tar_fd, skip, SEEK_CUR) == (off_t)-1) return -1;
+/* Copies path to the end of the buffer *paths, to use it once the index lock is
+   dropped. Returns its offset in the buffer, or -1. */
+static ssize_t paths_add(char **paths, size_t *len, size_t *cap, const char *path) {
+    size_t n = strlen(path) + 1;
+    if (*len + n > *cap) {
+        size_t grown_cap = *cap ? 2 * *cap : 16 * 1024;
+        while (grown_cap < *len + n) grown_cap *= 2;
+        char *grown = realloc(*paths, grown_cap);
+        if (!grown) return -1;
+        *paths = grown;
+        *cap = grown_cap;
     }
+    memcpy(*paths + *len, path, n);
+    *len += n;
+    return (ssize_t)(*len - n);
 }
 
-/**
- * Checks whether the archive is valid.
- *
- * Each non-null header of a valid archive has:
- *  - a magic value of "ustar" and a null,
- *  - a version value of "00" and no null,
- *  - a correct checksum
- *
- * @param tar_fd A file descriptor pointing to the start of a file supposed to contain a tar archive.
- *
- * @return a zero or positive value if the archive is valid, representing the number of non-null headers in the archive,
- *         -1 if the archive contains a header with an invalid magic value,
- *         -2 if the archive contains a header with an invalid version value,
- *         -3 if the archive contains a header with an invalid checksum value
- */
-int check_archive(int tar_fd) {
-    // TODO
-    if (lseek(tar_fd, 0, SEEK_SET) == (off_t)-1) {
-        return -3;
+static int diff_add(struct diff_list *d, const char *path, int change, const struct entry_rec *e) {
+    if (d->n == d->cap) {
+        size_t cap = d->cap ? 2 * d->cap : 256;
+        struct diff_item *grown = realloc(d->items, cap * sizeof(*grown));
+        if (!grown) return -1;
+        d->items = grown;
+        d->cap = cap;
     }
+    ssize_t off = paths_add(&d->paths, &d->paths_len, &d->paths_cap, path);
+    if (off == -1) return -1;
 
-    int count = 0;
-    tar_header_t h;
+    struct diff_item *item = &d->items[d->n++];
+    item->path = (size_t)off;
+    item->change = change;
+    item->start = e ? e->start : 0;
+    item->len = e ? e->hdr + round_up_512(e->size) : 0;
+    item->data = e ? e->start + e->hdr : 0;
+    item->size = e ? e->size : 0;
+    item->old_data = 0;
+    return 0;
+}
 
-    while (1) {
-        ssize_t r = read(tar_fd, &h, sizeof(h));
-        if (r != (ssize_t)sizeof(h)) {
-            return -3;
+/* The next path of the view in by_path order from *pos on, as the record of its
+   last visible copy, or NO_ENTRY at the end. */
+static uint32_t next_path(const struct index_view *v, size_t *pos) {
+    const struct tar_index *idx = v->idx;
+    while (*pos < idx->n) {
+        /* the copies of a path come in archive order: keep the last one the view sees */
+        uint32_t id = idx->by_path[(*pos)++];
+        const char *path = rec_path(idx, id);
+        while (*pos < idx->n && strcmp(rec_path(idx, idx->by_path[*pos]), path) == 0) {
+            uint32_t next = idx->by_path[(*pos)++];
+            if (next < v->n) id = next;
         }
+        if (id < v->n) return id;
+    }
+    return NO_ENTRY;
+}
 
-        if (is_zero_block((const uint8_t *)&h)) {
-            tar_header_t h2;
-            ssize_t r2 = read(tar_fd, &h2, sizeof(h2));
-            if (r2 != (ssize_t)sizeof(h2)) return -3;
-            if (!is_zero_block((const uint8_t *)&h2)) return -3;
-            return count;
-        }
+/* Whether the data of the pending item differs between the archives. Returns 1
+   if so, 0 if not, -1 on error. */
+static int content_differs(struct tar_src *os, struct tar_src *ns, const struct diff_item *item,
+                           struct diff_list *d) {
+    if (!d->buf && !(d->buf = malloc(2 * DIFF_CHUNK))) return -1;
+    uint8_t *a = d->buf, *b = d->buf + DIFF_CHUNK;
+    int r = 0;
 
-        if (memcmp(h.magic, TMAGIC, TMAGLEN - 1) != 0 || h.magic[TMAGLEN - 1] != '\0') {
-            return -1;
-        }
+    for (off_t done = 0; r == 0 && done < item->size; done += DIFF_CHUNK) {
+        size_t n = item->size - done < DIFF_CHUNK ? (size_t)(item->size - done) : DIFF_CHUNK;
+        if (src_pread(os, a, n, item->old_data + done) != (ssize_t)n
+            || src_pread(ns, b, n, item->data + done) != (ssize_t)n) r = -1;
+        else if (memcmp(a, b, n) != 0) r = 1;
+    }
+    return r;
+}
 
-        if (memcmp(h.version, TVERSION, TVERSLEN) != 0) {
-            return -2;
-        }
+/* Whether the entry o of the old archive changed into e in the new one: 1 if so,
+   0 if not, 2 if only their data can tell. */
+static int entry_changed(const struct index_view *ov, uint32_t o_id, const struct index_view *nv, uint32_t e_id,
+                         int flags) {
+    const struct entry_rec *o = &ov->idx->recs[o_id], *e = &nv->idx->recs[e_id];
+    int is_file = e->type == REGTYPE || e->type == AREGTYPE;
 
-        unsigned int stored = (unsigned int)TAR_INT(h.chksum);
-        unsigned int expected = compute_checksum(&h);
-        if (stored != expected) {
-            return -3;
-        }
+    if (o->type != e->type && !(is_file && (o->type == REGTYPE || o->type == AREGTYPE))) return 1;
+    if (o->mode != e->mode || o->size != e->size) return 1;
+    if (strcmp(rec_link(ov->idx, o_id), rec_link(nv->idx, e_id)) != 0) return 1;
+    if (!(flags & TAR_DIFF_CONTENT)) return o->mtime != e->mtime;
+    return is_file && e->size > 0 ? 2 : 0;
+}
 
-        off_t size = (off_t)TAR_INT(h.size);
-        off_t skip = round_up_512(size);
-        if (skip > 0 && lseek(tar_fd, skip, SEEK_CUR) == (off_t)-1) {
-            return -3;
+/* Compares the data of the pending items, outside the index locks, keeping those
+   that differ as changed. Returns 0 on success, -1 on error. */
+static int diff_contents(struct tar_src *os, struct tar_src *ns, struct diff_list *d) {
+    size_t kept = 0;
+    for (size_t k = 0; k < d->n; k++) {
+        struct diff_item *item = &d->items[k];
+        if (item->change == DIFF_PENDING) {
+            int r = content_differs(os, ns, item, d);
+            if (r == -1) return -1;
+            if (r == 0) continue;
+            item->change = TAR_DIFF_CHANGED;
         }
-
-        count++;
+        d->items[kept++] = *item;
     }
+    d->n = kept;
+    return 0;
 }
 
-/**
- * Checks whether an entry exists in the archive.
- *
- * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
- * @param path A path to an entry in the archive.
- *
- * @return zero if no entry at the given path exists in the archive,
- *         any other value otherwise.
- */
-int exists(int tar_fd, char *path) {
-    // TODO
-    if (path == NULL) return -1;
+static int do_diff(const struct index_view *ov, const struct index_view *nv, int flags, struct diff_list *d) {
+    const struct tar_index *oi = ov->idx, *ni = nv->idx;
+    size_t i = 0, j = 0;
+    uint32_t o = next_path(ov, &i), e = next_path(nv, &j);
 
-    if (lseek(tar_fd, 0, SEEK_SET) == (off_t)-1) return -1;
+    /* an index cut short by a corrupt header would report the rest as removed or added */
+    if (!oi->complete || !ni->complete) return -1;
 
-    tar_header_t h;
-    char fullpath[PATHBUF];
+    while (o != NO_ENTRY || e != NO_ENTRY) {
+        int c = o == NO_ENTRY ? 1 : e == NO_ENTRY ? -1 : strcmp(rec_path(oi, o), rec_path(ni, e));
+        int r = 0;
+        if (c < 0) {
+            r = diff_add(d, rec_path(oi, o), TAR_DIFF_REMOVED, NULL);
+            o = next_path(ov, &i);
+        } else if (c > 0) {
+            r = diff_add(d, rec_path(ni, e), TAR_DIFF_ADDED, &ni->recs[e]);
+            e = next_path(nv, &j);
+        } else {
+            r = entry_changed(ov, o, nv, e, flags);
+            if (r == 1) {
+                r = diff_add(d, rec_path(ni, e), TAR_DIFF_CHANGED, &ni->recs[e]);
+            } else if (r == 2) {
+                r = diff_add(d, rec_path(ni, e), DIFF_PENDING, &ni->recs[e]);
+                if (r == 0) d->items[d->n - 1].old_data = oi->recs[o].start + oi->recs[o].hdr;
+            }
+            o = next_path(ov, &i);
+            e = next_path(nv, &j);
+        }
+        if (r == -1) return -1;
+    }
+    return 0;
+}
 
+/* Locks the indexes of both archives. Taking the second one while holding the
+   first only succeeds if it is up to date and no writer holds it: otherwise it
+   is brought up to date on its own, and both are taken again. */
+static int diff_views(struct tar_src *os, struct index_view *ov, struct tar_src *ns, struct index_view *nv) {
     while (1) {
-        ssize_t r = read(tar_fd, &h, sizeof(h));
-        if (r != (ssize_t)sizeof(h)) {
+        struct stat st;
+        if (index_get(os, ov) == -1) return -1;
+        call.syscalls++;
+        struct tar_index *idx = fstat(ns->fd, &st) == 0 ? index_acquire(&st, 1) : NULL;
+        if (!idx) {
+            index_put(ov);
             return -1;
         }
+        if (index_lock_fresh(idx, ns, &st, nv) == 0) return 0;
 
-        if (is_zero_block((const uint8_t *)&h)) {
-            return 0;
-        }
+        index_put(ov);
+        int r = index_lock(idx, ns, &st, nv);
+        if (r == 0) index_unlock(nv);
+        index_release(idx);
+        if (r == -1) return -1;
+    }
+}
 
-        if (header_path(&h, fullpath) == -1) {
-            return -1;
-        }
+/* Copies the added and changed entries of the new archive, headers included, to
+   the end of the delta archive. Returns 0 on success, -1 on error. */
+static int write_delta(int delta_fd, struct tar_src *ns, const struct diff_list *d) {
+    struct tar_src ds;
+    struct stat st;
+    off_t end = -1;
 
-        if (strcmp(fullpath, path) == 0) {
-            return 1;
-        }
+    // an empty file starts a new archive, compressed archives are read-only
+    call.syscalls++;
+    if (fstat(delta_fd, &st) == -1) return -1;
+    if (st.st_size == 0) {
+        end = 0;
+    } else {
+        if (src_open(&ds, delta_fd) == 0 && !ds.gz && archive_end(&ds, &end) == -1) end = -1;
+        src_close(&ds);
+    }
+    if (end == -1) return -1;
 
-        off_t size = (off_t)TAR_INT(h.size);
-        off_t skip = round_up_512(size);
-        if (skip > 0 && lseek(tar_fd, skip, SEEK_CUR) == (off_t)-1) {
-            return -1;
+    uint8_t *buf = malloc(DIFF_CHUNK);
+    int r = buf ? 0 : -1;
+    for (size_t k = 0; r == 0 && k < d->n; k++) {
+        const struct diff_item *item = &d->items[k];
+        if (item->change == TAR_DIFF_REMOVED) continue;
+        for (off_t done = 0; r == 0 && done < item->len; done += DIFF_CHUNK) {
+            size_t n = item->len - done < DIFF_CHUNK ? (size_t)(item->len - done) : DIFF_CHUNK;
+            if (src_pread(ns, buf, n, item->start + done) != (ssize_t)n) r = -1;
+            else if (pwrite_all(delta_fd, buf, n, end) == -1) r = -1;
+            else end += (off_t)n;
         }
     }
-}
+    free(buf);
 
-/**
- * Checks whether an entry exists in the archive and is a directory.
- *
- * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
- * @param path A path to an entry in the archive.
- *
- * @return zero if no entry at the given path exists in the archive or the entry is not a directory,
- *         any other value otherwise.
- */
-int is_dir(int tar_fd, char *path) {
-    // TODO
-    tar_header_t h;
-    int r = find_entry(tar_fd, path, &h);
-    if (r <= 0) return 0;
-    return (h.typeflag == DIRTYPE) ? 1 : 0;
+    // fermer l'archive par deux blocs nuls, même après une erreur
+    if (pwrite_all(delta_fd, zero_blocks, sizeof(zero_blocks), end) == -1) r = -1;
+    index_stale(delta_fd);
+    return r;
 }
 
 /**
- * Checks whether an entry exists in the archive and is a file.
+ * Compares two archives by path, in one pass over their indexes.
+ * An entry is changed when its type, mode, size or link target differ, or its
+ * mtime does (its data, with TAR_DIFF_CONTENT). Unlike the lookups of this library,
+ * the last copy of a path stands for it, as when tar extracts an archive grown
+ * with -r or -u.
  *
- * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
- * @param path A path to an entry in the archive.
+ * @param old_fd A file descriptor pointing to the start of the older archive.
+ * @param new_fd A file descriptor pointing to the start of the newer archive.
+ * @param cb Called, in path order, with the path of each difference, one of
+ *           TAR_DIFF_ADDED, TAR_DIFF_REMOVED or TAR_DIFF_CHANGED, and arg; may be NULL.
+ *           Returning non-zero stops the reports (the delta archive is still written).
+ * @param arg Passed to cb.
+ * @param flags 0, or TAR_DIFF_CONTENT.
+ * @param delta_fd -1, or a file descriptor on an empty file or a tar archive, open for
+ *                 writing, to which the added and changed entries of the newer archive
+ *                 are copied as they are stored (removals cannot be recorded in a tar archive).
  *
- * @return zero if no entry at the given path exists in the archive or the entry is not a file,
- *         any other value otherwise.
+ * @return the number of differences,
+ *         -1 in case of error (including an archive with a corrupt header).
  */
-int is_file(int tar_fd, char *path) {
-    // TODO
-    tar_header_t h;
-    int r = find_entry(tar_fd, path, &h);
-    if (r <= 0) return 0;
-    return (h.typeflag == REGTYPE || h.typeflag == AREGTYPE) ? 1 : 0;
-}
+int tar_diff(int old_fd, int new_fd, tar_diff_cb cb, void *arg, int flags, int delta_fd) {
+    if (flags & ~TAR_DIFF_CONTENT) return -1;
 
-/**
- * Checks whether an entry exists in the archive and is a symlink.
- *
- * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
- * @param path A path to an entry in the archive.
- * @return zero if no entry at the given path exists in the archive or the entry is not symlink,
- *         any other value otherwise.
- */
-int is_symlink(int tar_fd, char *path) {
-    // TODO
-    tar_header_t h;
-    int r = find_entry(tar_fd, path, &h);
-    if (r <= 0) return 0;
-    return (h.typeflag == SYMTYPE) ? 1 : 0;
+    struct tar_src os, ns;
+    struct index_view ov, nv;
+    struct diff_list d;
+    memset(&d, 0, sizeof(d));
+    memset(&os, 0, sizeof(os));
+    memset(&ns, 0, sizeof(ns));
+    int ret = -1;
+
+    stats_begin(TAR_OP_DIFF);
+    if (src_open(&os, old_fd) == 0 && src_open(&ns, new_fd) == 0 && diff_views(&os, &ov, &ns, &nv) == 0) {
+        ret = do_diff(&ov, &nv, flags, &d);
+        index_put(&nv);
+        index_put(&ov);
+    }
+    if (ret == 0) ret = diff_contents(&os, &ns, &d);
+    if (ret == 0 && d.n > INT32_MAX) ret = -1;
+    if (ret == 0 && delta_fd >= 0) ret = write_delta(delta_fd, &ns, &d);
+    if (ret == 0) ret = (int)d.n;
+
+    struct stats_paused paused;
+    stats_pause(&paused);
+    for (size_t k = 0; ret >= 0 && cb && k < d.n; k++) {
+        if (cb(d.paths + d.items[k].path, d.items[k].change, arg) != 0) break;
+    }
+    stats_resume(&paused);
+    src_close(&ns);
+    src_close(&os);
+    stats_end();
+    free(d.items);
+    free(d.paths);
+    free(d.buf);
+    return ret;
 }
 
-/**
- * Lists the entries at a given path in the archive.
- * list() does *not* recurse into the directories listed at the given path.
- * If the path is NULL, it lists the entries at the root of the archive.
- *
- * Example:
- *  dir/          list(..., "dir/", ...) lists "dir/a", "dir/b", "dir/c/" and "dir/e/"
- *   ├── a
- *   ├── b
- *   ├── c/
- *   │   └── d
- *   └── e/
- *
- * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
- * @param path A path to an entry in the archive. If the entry is a symlink, it must be resolved to its linked-to entry.
- * @param entries An array of char arrays, each one is long enough to contain a tar entry path.
- * @param no_entries An in-out argument.
- *                   The caller set it to the number of entries in `entries`.
- *                   The callee set it to the number of entries listed.
+/*
+ * Content checksums. check_archive() only covers the headers; tar_checksum_write()
+ * records the CRC32C of every file's data in a sidecar file, and
+ * tar_checksum_verify() checks the archive against it later. Entries are cut into
+ * CRC_PIECE pieces that threads checksum in any order (par_for()); the
+ * CRCs of the pieces of an entry are then combined into the entry's, so that a
+ * single large file is read in parallel too. CRC32C runs on the SSE4.2 crc32
+ * instruction when the CPU has it, on tables otherwise.
  *
- * @return zero if no directory at the given path exists in the archive,
- *         1 in case of success,
- *         -1 in case of error.
+ * The sidecar is text: a "tar-crc32c 1" line, then one line per file entry, in
+ * archive order: its CRC in hex, the offset of its first header, its size and its
+ * path (for the reports only, newlines replaced by '?').
  */
-int list(int tar_fd, char *path, char **entries, size_t *no_entries) {
-    // pas besoin de checker l'archive, on suppose qu'elle est valide
 
-    if (no_entries == NULL || entries == NULL) return -1;
+#define CRC_PIECE (4L << 20)          /* bytes checksummed by a thread at once */
+#define CRC_LINES (1L << 20)          /* bytes of sidecar written at once */
+#define CRC32C_POLY 0x82f63b78u      /* reflected Castagnoli polynomial */
+#define CRC_MAGIC "tar-crc32c 1\n"
 
+static uint32_t crc32c_table[8][256];
+static uint32_t crc32c_piece_op[32];  /* appends CRC_PIECE zero bytes to a CRC */
+static uint32_t (*crc32c_fn)(uint32_t crc, const uint8_t *p, size_t len);
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
 
-    // check symlink here + resolve to linked-to entry
-    if (path != NULL && strcmp(path, "") != 0 && is_symlink(tar_fd, path)) {
-        tar_header_t h;
-        int r = find_entry(tar_fd, path, &h); // find_entry() toujours un problème car quand on récupères le path d'un symlink, on n'a pas le "/" à la fin
-        //find_entry(tar_fd, path, &h); // find_entry() toujours un problème car quand on récupères le path d'un symlink, on n'a pas le "/" à la fin
+/* Slicing by 8: eight bytes per step, through one table each. */
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *p, size_t len) {
+    crc = ~crc;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        w ^= crc;
+        crc = crc32c_table[7][w & 0xff] ^ crc32c_table[6][(w >> 8) & 0xff]
+            ^ crc32c_table[5][(w >> 16) & 0xff] ^ crc32c_table[4][(w >> 24) & 0xff]
+            ^ crc32c_table[3][(w >> 32) & 0xff] ^ crc32c_table[2][(w >> 40) & 0xff]
+            ^ crc32c_table[1][(w >> 48) & 0xff] ^ crc32c_table[0][w >> 56];
+    }
+#endif
+    while (len--) crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
 
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t *p, size_t len) {
+    uint64_t c = ~crc;
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        c = _mm_crc32_u64(c, w);
+    }
+    while (len--) c = _mm_crc32_u8((uint32_t)c, *p++);
+    return ~(uint32_t)c;
+}
+#endif
 
-        // find_entry works and seems to give the correct real path for the symlink target, but despite the return valuea being 1,
-        // the prints here don't print and the list() function returns 1 despite giving nothing in the entries array
-        //printf(" r from find_entry: %d\n", r);
-        if (r == -1) return -1;
+/* Multiplies the 32x32 matrix mat over GF(2) by vec. */
+static uint32_t gf2_times(const uint32_t *mat, uint32_t vec) {
+    uint32_t sum = 0;
+    for (; vec; vec >>= 1, mat++)
+        if (vec & 1) sum ^= *mat;
+    return sum;
+}
 
-        //printf("hey\n");
+static void gf2_square(uint32_t *square, const uint32_t *mat) {
+    for (int n = 0; n < 32; n++) square[n] = gf2_times(mat, mat[n]);
+}
 
-        header_path(&h, path);
-        //printf("resolved symlink path: %s\n", path);
+/* The CRC of A followed by B, from crc1 = CRC(A), crc2 = CRC(B) and the length of B
+   (as zlib's crc32_combine(), with the Castagnoli polynomial). */
+static uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, uint64_t len2) {
+    uint32_t even[32], odd[32];
+    if (len2 == 0) return crc1;
 
-        /*
-        if (r == -1) return -1;
-        if (r == 1 && h.typeflag == SYMTYPE) {
-            // resolve symlink
-            char link_target[PATHBUF];
-            memcpy(link_target, h.linkname, sizeof(h.linkname));
-            link_target[sizeof(h.linkname)] = '\0';
+    /* the operator for one zero bit, then two, then four */
+    odd[0] = CRC32C_POLY;
+    for (int n = 1; n < 32; n++) odd[n] = 1u << (n - 1);
+    gf2_square(even, odd);
+    gf2_square(odd, even);
 
-            // update path to linked-to entry
-            path = link_target;
-            printf("paht is symlink, resolved to: %s\n", path);
-        }
-        */
-    }
+    /* apply len2 zero bytes to crc1, squaring the operator for each bit of len2 */
+    do {
+        gf2_square(even, odd);
+        if (len2 & 1) crc1 = gf2_times(even, crc1);
+        len2 >>= 1;
+        if (len2 == 0) break;
+        gf2_square(odd, even);
+        if (len2 & 1) crc1 = gf2_times(odd, crc1);
+        len2 >>= 1;
+    } while (len2);
+    return crc1 ^ crc2;
+}
 
-    // needs to return 0 if no directory at the given path exists in the archive
-    if (path != NULL && strcmp(path, "") != 0 && is_dir(tar_fd, path) == 0) {
-        //printf("no path, not a dir or not root \n");
-        *no_entries = 0;
-        return 0;
+static void crc32c_init(void) {
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t c = n;
+        for (int k = 0; k < 8; k++) c = c & 1 ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+        crc32c_table[0][n] = c;
     }
+    for (int n = 0; n < 256; n++)
+        for (int k = 1; k < 8; k++)
+            crc32c_table[k][n] = crc32c_table[0][crc32c_table[k - 1][n] & 0xff] ^ (crc32c_table[k - 1][n] >> 8);
 
+    /* combining is linear in crc1: the operator is its image of each bit */
+    for (int n = 0; n < 32; n++) crc32c_piece_op[n] = crc32c_combine(1u << n, 0, CRC_PIECE);
 
+    crc32c_fn = crc32c_sw;
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2")) crc32c_fn = crc32c_hw;
+#endif
+}
 
-    // if path is NULL, set it to the tar root
-    char *list_path;
-    char normalized_path[PATHBUF]; // path with trailing slash
+#define CRC_PENDING 0                 /* the data is still to checksum */
 
-    if (!path || strcmp(path, "") == 0) {
-        list_path = "";          // tar root
-    } else {
-        strncpy(normalized_path, path, sizeof(normalized_path) - 1);
-        normalized_path[sizeof(normalized_path) - 1] = '\0';
+/* A file copied out of the index, and what was found about it. */
+struct crc_item {
+    size_t path;                      /* offset in crc_list.paths */
+    int status;                       /* TAR_CHECKSUM_*, or CRC_PENDING */
+    uint32_t crc;                     /* recorded in the sidecar, when verifying */
+    int64_t start;
+    int64_t data;
+    int64_t size;
+};
 
-        // être sûr d'avoir un slash à la fin -> ok de juste rajouter un caratère ?
-        size_t len = strlen(normalized_path);
-        if (normalized_path[len - 1] != '/') {
-            normalized_path[len] = '/';
-            normalized_path[len + 1] = '\0';
-        }
+struct crc_list {
+    struct crc_item *items;
+    size_t n;
+    size_t cap;
+    char *paths;
+    size_t paths_len;
+    size_t paths_cap;
+};
 
-        list_path = normalized_path;
-    }
+struct crc_job {
+    int fd;
+    int gz;
+    off_t limit;                      /* the caller's snapshot, which every piece reads */
+    const struct crc_list *l;
+    size_t *first;                    /* first piece of each item, n + 1 of them */
+    uint32_t *piece_crc;
+};
 
-    //printf("list path: %s\n", list_path);
+/* What a thread keeps across the pieces it checksums. */
+struct crc_worker {
+    struct tar_src src;
+    uint8_t *buf;
+    size_t k;                         /* item of its last piece */
+};
 
+static int crc_add(struct crc_list *l, const char *path, int status, const struct entry_rec *e, uint32_t crc) {
+    if (l->n == l->cap) {
+        size_t cap = l->cap ? 2 * l->cap : 256;
+        struct crc_item *grown = realloc(l->items, cap * sizeof(*grown));
+        if (!grown) return -1;
+        l->items = grown;
+        l->cap = cap;
+    }
+    ssize_t off = paths_add(&l->paths, &l->paths_len, &l->paths_cap, path);
+    if (off == -1) return -1;
 
-    if (lseek(tar_fd, 0, SEEK_SET) == (off_t)-1) return -1; // moves the file descriptor to the beginning of the tar => really needed ?
+    struct crc_item *item = &l->items[l->n++];
+    item->path = (size_t)off;
+    item->status = status;
+    item->crc = crc;
+    item->start = e ? e->start : 0;
+    item->data = e ? e->start + e->hdr : 0;
+    item->size = e ? e->size : 0;
+    return 0;
+}
 
-    tar_header_t header;
-    char file_path[PATHBUF];
-    int number_of_entries = 0;
-    int max_number_of_entries = (int)(*no_entries);
+static void crc_list_free(struct crc_list *l) {
+    free(l->items);
+    free(l->paths);
+}
 
-    while (1) {
-        // checks if we reached max entries
-        if (number_of_entries >= max_number_of_entries) {
-            return 1;
-        }
+static void crc_release(void *local) {
+    struct crc_worker *w = local;
+    src_close(&w->src);
+    free(w->buf);
+    free(w);
+}
 
-        const ssize_t r = read(tar_fd, &header, sizeof(header));
-        if (r != (ssize_t)sizeof(header)) {
-            return -1;
-        }
-        if (is_zero_block((const uint8_t *)&header)) {
-            return 1; // needs to return 1 if success
-        }
-        // get path
-        if (header_path(&header, file_path) == -1) {
-            return -1;
-        }
+static int crc_piece(void *arg, size_t p, void **local) {
+    const struct crc_job *j = arg;
+    struct crc_worker *w = *local;
+    if (!w) {
+        if (!(w = calloc(1, sizeof(*w)))) return -1;
+        *local = w;
+        if (!(w->buf = malloc(CRC_PIECE)) || src_open_known(&w->src, j->fd, j->limit, j->gz) == -1) return -1;
+    }
 
-        // vérification ici !
+    /* the item of piece p: pieces are handed out in order, it is rarely far */
+    if (p < j->first[w->k]) w->k = 0;
+    while (j->first[w->k + 1] <= p) w->k++;
+    const struct crc_item *item = &j->l->items[w->k];
+    off_t done = (off_t)(p - j->first[w->k]) * CRC_PIECE;
+    size_t len = item->size - done < CRC_PIECE ? (size_t)(item->size - done) : CRC_PIECE;
 
+    if (src_pread(&w->src, w->buf, len, item->data + done) != (ssize_t)len) return -1;
+    j->piece_crc[p] = crc32c_fn(0, w->buf, len);
+    src_dontneed(&w->src, item->data + done, len);
+    return 0;
+}
 
-        // add to entries if match
-        if (is_direct_child(file_path, list_path)) {
-            //entries[number_of_entries] = file_path; // wrong ! Revient à faire pointer l'entrée vers la même zone mémoire à chaque fois
-            //strncpy(entries[number_of_entries], file_path, PATHBUF); // copier le contenu -> PROBLEM HERE
-            strncpy(entries[number_of_entries], file_path, strlen(file_path) + 1);
+/* Checksums the data of the pending items of l, read through the snapshot of src,
+   into crcs (one per item). Returns 0 on success, -1 on error. */
+static int crc_items(const struct tar_src *src, const struct crc_list *l, uint32_t *crcs) {
+    struct crc_job j;
+    j.fd = src->fd;
+    j.gz = src->gz != NULL;
+    j.limit = src->limit;
+    j.l = l;
+    pthread_once(&crc32c_once, crc32c_init);
 
-            number_of_entries++;
-        }
+    j.first = malloc((l->n + 1) * sizeof(*j.first));
+    if (!j.first) return -1;
+    j.first[0] = 0;
+    for (size_t k = 0; k < l->n; k++) {
+        const struct crc_item *item = &l->items[k];
+        j.first[k + 1] = j.first[k] + (item->status == CRC_PENDING ? (size_t)((item->size + CRC_PIECE - 1) / CRC_PIECE) : 0);
+    }
+    size_t pieces = j.first[l->n];
+    j.piece_crc = malloc((pieces ? pieces : 1) * sizeof(*j.piece_crc));
+    if (!j.piece_crc) {
+        free(j.first);
+        return -1;
+    }
 
-        *no_entries = number_of_entries;
+    /* a compressed stream is inflated by one thread at a time anyway */
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int r = par_for(pieces, j.gz || cpus < 1 ? 1 : (size_t)cpus, crc_piece, crc_release, &j);
 
-        // moves file descriptor to next header by skipping file content
-        off_t size = (off_t)TAR_INT(header.size);
-        off_t skip = round_up_512(size);
-        if (skip > 0 && lseek(tar_fd, skip, SEEK_CUR) == (off_t)-1) {
-            return -1;
+    for (size_t k = 0; r == 0 && k < l->n; k++) {
+        int64_t size = l->items[k].size;
+        uint32_t crc = 0;
+        for (size_t p = j.first[k]; p < j.first[k + 1]; p++) {
+            int64_t done = (int64_t)(p - j.first[k]) * CRC_PIECE;
+            if (size - done < CRC_PIECE) crc = crc32c_combine(crc, j.piece_crc[p], (uint64_t)(size - done));
+            else crc = gf2_times(crc32c_piece_op, crc) ^ j.piece_crc[p];
         }
+        crcs[k] = crc;
     }
+    free(j.first);
+    free(j.piece_crc);
+    return r;
+}
 
+static int rec_is_file(const struct entry_rec *e) {
+    return e->type == REGTYPE || e->type == AREGTYPE;
+}
 
+/* Copies the visible files of the view to l, in archive order. Returns 0 on success, -1 on error. */
+static int crc_list_files(const struct index_view *v, struct crc_list *l) {
+    /* without the whole archive the sidecar would leave entries out */
+    if (!v->idx->complete) return -1;
+    for (uint32_t id = 0; id < v->n; id++) {
+        const struct entry_rec *e = &v->idx->recs[id];
+        if (rec_is_file(e) && crc_add(l, rec_path(v->idx, id), CRC_PENDING, e, 0) == -1) return -1;
+    }
     return 0;
 }
 
+/* Checksums the files of l and writes the sidecar. Returns 0 on success, -1 on error. */
+static int write_sidecar(struct tar_src *src, const struct crc_list *l, int sidecar_fd) {
+    uint32_t *crcs = malloc((l->n ? l->n : 1) * sizeof(*crcs));
+    char *buf = malloc(CRC_LINES);
+    int r = crcs && buf ? 0 : -1;
+    if (r == 0) r = crc_items(src, l, crcs);
+
+    call.syscalls++;
+    if (r == 0 && ftruncate(sidecar_fd, 0) == -1) r = -1;
+
+    size_t len = 0;
+    off_t off = 0;
+    if (r == 0) {
+        memcpy(buf, CRC_MAGIC, sizeof(CRC_MAGIC) - 1);
+        len = sizeof(CRC_MAGIC) - 1;
+    }
+    for (size_t k = 0; r == 0 && k <= l->n; k++) {
+        /* flush when the next line may not fit, and at the end */
+        const char *path = k < l->n ? l->paths + l->items[k].path : "";
+        size_t plen = strlen(path);
+        if (k == l->n || len + plen + 64 > CRC_LINES) {
+            if (pwrite_all(sidecar_fd, buf, len, off) == -1) r = -1;
+            off += (off_t)len;
+            len = 0;
+        }
+        if (k == l->n || r == -1) break;
+        if (plen + 64 > CRC_LINES) {
+            r = -1;
+            break;
+        }
+        const struct crc_item *item = &l->items[k];
+        len += (size_t)snprintf(buf + len, CRC_LINES - len, "%08x %lld %lld ", crcs[k],
+                                (long long)item->start, (long long)item->size);
+        for (size_t c = 0; c < plen; c++) buf[len++] = path[c] == '\n' ? '?' : path[c];
+        buf[len++] = '\n';
+    }
+    free(buf);
+    free(crcs);
+    return r;
+}
+
 /**
- * Adds a file at the end of the archive, at the archive's root level.
- * The archive's metadata must be updated accordingly.
- * For the file header, only the name, size, typeflag, magic value (to "ustar"), version value (to "00") and checksum fields need to be correctly set.
+ * Computes the CRC32C of the data of every file in the archive and writes them
+ * to a sidecar file, to be checked later by tar_checksum_verify(). The files are
+ * checksummed in parallel, large ones included.
  *
- * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
- * @param filename The name of the file to add. If an entry already exists with the same name, the file is not written, and the function returns -1.
- * @param src A source buffer containing the file content to add.
- * @param len The length of the source buffer.
+ * @param tar_fd A file descriptor pointing to the start of a valid tar file.
+ * @param sidecar_fd A file descriptor open for writing, whose content is replaced.
  *
- * @return 0 if the file was added successfully,
- *         -1 if the archive already contains an entry at the given path,
- *         -2 if an error occurred
+ * @return the number of files checksummed,
+ *         -1 in case of error (including an archive with a corrupt header).
  */
-int add_file(int tar_fd, char *filename, uint8_t *src, size_t len) {
+int tar_checksum_write(int tar_fd, int sidecar_fd) {
+    struct tar_src src;
+    struct index_view v;
+    struct crc_list l;
+    memset(&src, 0, sizeof(src));
+    memset(&l, 0, sizeof(l));
+    int ret = -1;
 
-    if (!filename || !src) return -2;
+    stats_begin(TAR_OP_CHECKSUM_WRITE);
+    if (src_open(&src, tar_fd) == 0 && index_get(&src, &v) == 0) {
+        ret = crc_list_files(&v, &l);
+        index_put(&v);
+    }
+    if (ret == 0) ret = l.n > INT32_MAX ? -1 : write_sidecar(&src, &l, sidecar_fd);
+    if (ret == 0) ret = (int)l.n;
+    src_close(&src);
+    stats_end();
+    crc_list_free(&l);
+    return ret;
+}
 
+/* Reads the whole sidecar into a NUL-terminated buffer. Returns it, or NULL. */
+static char *read_sidecar(int fd, size_t *len) {
+    struct stat st;
+    call.syscalls++;
+    if (fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(CRC_MAGIC) - 1) return NULL;
+    char *buf = malloc((size_t)st.st_size + 1);
+    if (!buf) return NULL;
 
-    // if entry already exists -> error
-    if (exists(tar_fd, filename)) {
-        perror("add_file () : file already exists");
-        return -1;
+    size_t got = 0;
+    while (got < (size_t)st.st_size) {
+        call.syscalls++;
+        ssize_t r = pread(fd, buf + got, (size_t)st.st_size - got, (off_t)got);
+        if (r == -1 && errno == EINTR) continue;
+        if (r <= 0) {
+            free(buf);
+            return NULL;
+        }
+        call.bytes_read += (uint64_t)r;
+        got += (size_t)r;
     }
+    buf[got] = '\0';
+    *len = got;
+    return buf;
+}
 
+/* The entry of the view whose first header is at start, or NO_ENTRY. */
+static uint32_t rec_at(const struct index_view *v, int64_t start) {
+    uint32_t lo = 0, hi = v->n;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (v->idx->recs[mid].start < start) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo < v->n && v->idx->recs[lo].start == start ? lo : NO_ENTRY;
+}
 
-    // find end of archive (first zero block)
-    if (lseek(tar_fd, 0, SEEK_SET) == (off_t)-1) return -2;
-
-    tar_header_t h;
-    while (1) {
-        ssize_t r = read(tar_fd, &h, sizeof(h));
-        if (r != (ssize_t)sizeof(h)) return -2;
+/* Matches the lines of the sidecar to the files of the view, into l: the missing
+   entries in the order of the sidecar, then the files in archive order, pending
+   with the CRC recorded for them or unrecorded. Returns 0 on success, -1 on error. */
+static int crc_match(const struct index_view *v, char *side, size_t side_len, struct crc_list *l) {
+    const struct tar_index *idx = v->idx;
+    uint8_t *seen = calloc(v->n ? v->n : 1, 1);
+    uint32_t *want = malloc((v->n ? v->n : 1) * sizeof(*want));
+    int r = seen && want ? 0 : -1;
 
-        if (is_zero_block((const uint8_t *)&h)) {
-            tar_header_t h2;
-            ssize_t r2 = read(tar_fd, &h2, sizeof(h2));
-            if (r2 != (ssize_t)sizeof(h2)) return -2;
+    if (r == 0 && (!idx->complete || strncmp(side, CRC_MAGIC, sizeof(CRC_MAGIC) - 1) != 0)) r = -1;
 
-            if (is_zero_block((const uint8_t *)&h2)) {
-                /* two consecutive zero blocks -> rewind to start of the first zero block */
-                if (lseek(tar_fd, -(off_t)(2 * BLOCKSIZE), SEEK_CUR) == (off_t)-1)
-                    return -2;
-                break;
-            } else {
-                /* false alarm: position back at start of h2 so next loop will process it */
-                if (lseek(tar_fd, -(off_t)BLOCKSIZE, SEEK_CUR) == (off_t)-1)
-                    return -2;
-                continue;
-            }
+    /* a line stands for the file still at the same place, with the same size */
+    char *line = side + sizeof(CRC_MAGIC) - 1;
+    while (r == 0 && line < side + side_len) {
+        char *eol = memchr(line, '\n', side + side_len - line), *end;
+        if (!eol) {
+            r = -1;
+            break;
+        }
+        *eol = '\0';
+        errno = 0;
+        unsigned long crc = strtoul(line, &end, 16);
+        long long start = end != line && *end == ' ' ? strtoll(end + 1, &end, 10) : -1;
+        long long size = start >= 0 && *end == ' ' ? strtoll(end + 1, &end, 10) : -1;
+        if (errno || crc > UINT32_MAX || start < 0 || size < 0 || *end != ' ') {
+            r = -1;
+            break;
         }
 
-        off_t size = (off_t)TAR_INT(h.size);
-        off_t skip = round_up_512(size);
-        if (skip && lseek(tar_fd, skip, SEEK_CUR) == (off_t)-1)
-            return -2;
+        uint32_t id = rec_at(v, start);
+        const struct entry_rec *e = id == NO_ENTRY ? NULL : &idx->recs[id];
+        if (e && !seen[id] && rec_is_file(e) && e->size == size) {
+            seen[id] = 1;
+            want[id] = (uint32_t)crc;
+        } else {
+            r = crc_add(l, end + 1, TAR_CHECKSUM_MISSING, NULL, 0);
+        }
+        line = eol + 1;
     }
 
-    // build new header
-    tar_header_t newh;
-    memset(&newh, 0, sizeof(newh));
-
-    // name
-    strncpy(newh.name, filename, sizeof(newh.name));
-
-    // size (octal)
-    snprintf(newh.size, sizeof(newh.size), "%011o", (unsigned int)len);
-
-    // type, magic et version
-    newh.typeflag = REGTYPE;
-    memcpy(newh.magic, TMAGIC, TMAGLEN);
-    memcpy(newh.version, TVERSION, TVERSLEN);
+    for (uint32_t id = 0; r == 0 && id < v->n; id++) {
+        const struct entry_rec *e = &idx->recs[id];
+        if (seen[id]) r = crc_add(l, rec_path(idx, id), CRC_PENDING, e, want[id]);
+        else if (rec_is_file(e)) r = crc_add(l, rec_path(idx, id), TAR_CHECKSUM_UNRECORDED, e, 0);
+    }
+    free(want);
+    free(seen);
+    return r;
+}
 
-    // checksum: fill with spaces first
-    memset(newh.chksum, ' ', sizeof(newh.chksum));
-    unsigned int cksum = compute_checksum(&newh);
-    snprintf(newh.chksum, sizeof(newh.chksum), "%06o", cksum);
-    newh.chksum[6] = '\0';
-    newh.chksum[7] = ' ';
+/* Checksums the pending files of l, keeping those whose CRC changed as mismatches.
+   Returns 0 on success, -1 on error. */
+static int crc_check(struct tar_src *src, struct crc_list *l) {
+    uint32_t *crcs = malloc((l->n ? l->n : 1) * sizeof(*crcs));
+    if (!crcs || crc_items(src, l, crcs) == -1) {
+        free(crcs);
+        return -1;
+    }
+    size_t kept = 0;
+    for (size_t k = 0; k < l->n; k++) {
+        struct crc_item *item = &l->items[k];
+        if (item->status == CRC_PENDING) {
+            if (crcs[k] == item->crc) continue;
+            item->status = TAR_CHECKSUM_MISMATCH;
+        }
+        l->items[kept++] = *item;
+    }
+    l->n = kept;
+    free(crcs);
+    return 0;
+}
 
+/**
+ * Checks the data of the files in the archive against the CRC32C recorded by
+ * tar_checksum_write(). A file is matched to its line by the offset of its header
+ * and its size, so that a sidecar stays valid for the entries an append leaves in place.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar file.
+ * @param sidecar_fd A file descriptor on a sidecar written by tar_checksum_write().
+ * @param cb Called with the path of each problem, one of TAR_CHECKSUM_MISMATCH,
+ *           TAR_CHECKSUM_MISSING or TAR_CHECKSUM_UNRECORDED, and arg; may be NULL.
+ *           The missing entries come first, in the order of the sidecar, then the
+ *           others in archive order. Returning non-zero stops the reports.
+ * @param arg Passed to cb.
+ *
+ * @return the number of problems (zero if the archive is intact),
+ *         -1 in case of error (including a malformed sidecar or an archive with a corrupt header).
+ */
+int tar_checksum_verify(int tar_fd, int sidecar_fd, tar_checksum_cb cb, void *arg) {
+    struct tar_src src;
+    struct index_view v;
+    struct crc_list l;
+    memset(&src, 0, sizeof(src));
+    memset(&l, 0, sizeof(l));
+    size_t side_len;
+    int ret = -1;
 
-    // write header
-    if (write(tar_fd, &newh, sizeof(newh)) != sizeof(newh)){
-        return -2;
+    stats_begin(TAR_OP_CHECKSUM_VERIFY);
+    char *side = read_sidecar(sidecar_fd, &side_len);
+    if (side && src_open(&src, tar_fd) == 0 && index_get(&src, &v) == 0) {
+        ret = crc_match(&v, side, side_len, &l);
+        index_put(&v);
     }
+    if (ret == 0) ret = crc_check(&src, &l);
+    if (ret == 0) ret = l.n > INT32_MAX ? -1 : (int)l.n;
 
+    struct stats_paused paused;
+    stats_pause(&paused);
+    for (size_t k = 0; ret >= 0 && cb && k < l.n; k++) {
+        if (cb(l.paths + l.items[k].path, l.items[k].status, arg) != 0) break;
+    }
+    stats_resume(&paused);
+    src_close(&src);
+    stats_end();
+    free(side);
+    crc_list_free(&l);
+    return ret;
+}
 
+/**
+ * Copies the counters of the calls made so far, per API function.
+ * A call made from within another one (the exists() of an add_file()) is counted in the outer one.
+ * The calls made from a callback of tar_find(), tar_diff() or tar_checksum_verify() are counted on
+ * their own, and the time spent in the callbacks is not part of the latency of the call running them.
+ *
+ * @param scope TAR_STATS_GLOBAL or TAR_STATS_THREAD.
+ * @param out Where to copy the counters.
+ *
+ * @return 0 on success,
+ *         -1 if the scope is unknown.
+ */
+int tar_stats_get(int scope, tar_stats_t *out) {
+    if (!out) return -1;
+    if (scope == TAR_STATS_THREAD) {
+        *out = thread_stats;
+        return 0;
+    }
+    if (scope != TAR_STATS_GLOBAL) return -1;
 
-    // write file data
-    if (len > 0 && write(tar_fd, src, len) != (ssize_t)len){
-        return -2;
+    /* the counters are all uint64_t, read them one at a time */
+    const uint64_t *from = (const uint64_t *)&global_stats;
+    uint64_t *to = (uint64_t *)out;
+    for (size_t i = 0; i < sizeof(tar_stats_t) / sizeof(uint64_t); i++) {
+        to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
     }
+    return 0;
+}
 
+/**
+ * Sets the counters of a scope back to zero.
+ *
+ * @param scope TAR_STATS_GLOBAL or TAR_STATS_THREAD.
+ */
+void tar_stats_reset(int scope) {
+    if (scope == TAR_STATS_THREAD) {
+        memset(&thread_stats, 0, sizeof(thread_stats));
+        return;
+    }
+    if (scope != TAR_STATS_GLOBAL) return;
 
-    // pad file data to 512 bytes
-    size_t padding = round_up_512(len) - len;
-    if (padding) {
-        uint8_t pad[BLOCKSIZE] = {0};
-        if (write(tar_fd, pad, padding) != (ssize_t)padding)
-            return -2;
+    uint64_t *counters = (uint64_t *)&global_stats;
+    for (size_t i = 0; i < sizeof(tar_stats_t) / sizeof(uint64_t); i++) {
+        __atomic_store_n(&counters[i], 0, __ATOMIC_RELAXED);
     }
+}
 
-    // write two zero blocks (end of archive)
-    uint8_t zero[BLOCKSIZE] = {0};
-    if (write(tar_fd, zero, BLOCKSIZE) != BLOCKSIZE) return -2;
-    if (write(tar_fd, zero, BLOCKSIZE) != BLOCKSIZE) return -2;
+/**
+ * Turns the recording of call latencies on or off. It is off by default, since it
+ * costs two clock reads per call.
+ *
+ * @param enable Non-zero to record latencies, zero to stop.
+ */
+void tar_stats_latency(int enable) {
+    atomic_store(&record_latency, enable ? 1 : 0);
+}
 
-    return 0;
+/**
+ * Returns the name of an API function, e.g. "exists" for TAR_OP_EXISTS, or NULL.
+ *
+ * @param op One of the TAR_OP_* values.
+ */
+const char *tar_op_name(int op) {
+    return op >= 0 && op < TAR_OP_COUNT ? op_names[op] : NULL;
 }
@@ -41,12 +41,24 @@ typedef struct posix_header
 /* Converts an ASCII-encoded octal-based number into a regular integer */
 #define TAR_INT(char_ptr) strtol(char_ptr, NULL, 8)
 
+/*
+ * All the functions below accept a plain tar archive as well as a gzip-compressed
+ * one (.tar.gz), which is detected from its magic bytes and inflated on the fly.
+ * Compressed archives are read-only: add_file() fails on them.
+ * Paths and link targets longer than the ustar fields are read from PAX extended
+ * headers and GNU long name headers.
+ * The lookups, from exists() to tar_find(), run on an index of the archive's entries
+ * built by the first of them and kept for the next ones. It follows the appends made
+ * through this library; changes made by other programs are told from the file's size
+ * and modification time.
+ */
+
 /**
  * Checks whether the archive is valid.
  *
  * Each non-null header of a valid archive has:
- *  - a magic value of "ustar" and a null,
- *  - a version value of "00" and no null,
+ *  - a magic value of "ustar" and a null, and a version value of "00" and no null,
+ *    or GNU tar's magic value of "ustar " and a version value of " " and a null,
  *  - a correct checksum
  *
  * @param tar_fd A file descriptor pointing to the start of a file supposed to contain a tar archive.
@@ -102,6 +114,9 @@ int is_file(int tar_fd, char *path);
  */
 int is_symlink(int tar_fd, char *path);
 
+/* Size of the buffers list() and tar_multi_list() copy entry paths to, null byte included. */
+#define TAR_PATH_MAX 512
+
 /**
  * Lists the entries at a given path in the archive.
  * list() does *not* recurse into the directories listed at the given path.
@@ -117,7 +132,8 @@ int is_symlink(int tar_fd, char *path);
  *
  * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
  * @param path A path to an entry in the archive. If the entry is a symlink, it must be resolved to its linked-to entry.
- * @param entries An array of char arrays, each one is long enough to contain a tar entry path.
+ * @param entries An array of char arrays of TAR_PATH_MAX bytes each. An entry path longer than that
+ *                (PAX or GNU long names are not bounded by the 255 bytes of a ustar header) makes list() fail.
  * @param no_entries An in-out argument.
  *                   The caller set it to the number of entries in `entries`.
  *                   The callee set it to the number of entries listed.
@@ -128,6 +144,25 @@ int is_symlink(int tar_fd, char *path);
  */
 int list(int tar_fd, char *path, char **entries, size_t *no_entries);
 
+/**
+ * Reads a file at a given path in the archive.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ * @param path A path to an entry in the archive to read from. If the entry is a symlink, it must be resolved to its linked-to entry.
+ * @param offset An offset in the file from which to start reading from, zero indicates the start of the file.
+ * @param dest A destination buffer to read the given file into.
+ * @param len An in-out argument.
+ *            The caller set it to the size of dest.
+ *            The callee set it to the number of bytes written to dest.
+ *
+ * @return -1 if no entry at the given path exists in the archive or the entry is not a file,
+ *         -2 if the offset is outside the file total length,
+ *         zero if the file was read in its entirety into the destination buffer,
+ *         a positive value if the file was partially read, representing the remaining bytes left to be read to reach
+ *         the end of the file.
+ */
+ssize_t read_file(int tar_fd, char *path, size_t offset, uint8_t *dest, size_t *len);
+
 /**
  * Adds a file at the end of the archive, at the archive's root level.
  * The archive's metadata must be updated accordingly.
@@ -140,8 +175,371 @@ int list(int tar_fd, char *path, char **entries, size_t *no_entries);
  *
  * @return 0 if the file was added successfully,
  *         -1 if the archive already contains an entry at the given path,
- *         -2 if an error occurred
+ *         -2 if an error occurred (or the archive is compressed, or the name is longer than the 100 bytes of a header's name field)
  */
 int add_file(int tar_fd, char *filename, uint8_t *src, size_t len);
 
+/**
+ * Selects the backend used to read archives.
+ * By default every read is a pread() issued one at a time. With io_uring, scans keep a
+ * read-ahead window of several chunks in flight and large reads are split in chunks
+ * submitted together, so the device sees a deeper queue. Falls back to pread() when a
+ * read cannot go through the ring.
+ *
+ * @param enable Non-zero to read through io_uring, zero to go back to pread().
+ *
+ * @return 0 on success,
+ *         -1 if io_uring is not available (pread() stays in use).
+ */
+int tar_use_uring(int enable);
+
+typedef struct tar_appender tar_appender_t;
+
+/**
+ * Repairs an archive left torn by an append that did not complete: an entry cut short
+ * by the end of the file, or data after the first zero block closing the archive.
+ * The archive is truncated back to its last complete entry and closed again with two zero blocks.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a tar archive file, open for writing.
+ *
+ * @return 0 if the archive was intact,
+ *         1 if a torn tail was truncated,
+ *         -1 in case of error (including a header with an invalid checksum, which is left untouched).
+ */
+int tar_recover(int tar_fd);
+
+/**
+ * Opens a durable appender on an archive, after repairing it with tar_recover().
+ * Appends made through it are written data first and committed by a single header
+ * write, then made durable with group commit: the appends of all the threads using
+ * the appender that arrive while a batch is written go together in the next batch,
+ * for two fdatasync() per batch.
+ * Meanwhile, the other functions of this library called in the same process, through any
+ * file descriptor on the archive, read it as it was at the last commit before they started:
+ * they never see a partially written append, nor wait for one in progress. After each
+ * commit though, the first call to find the archive grown brings its entry index up to
+ * date under an exclusive lock, and the calls on the archive that start meanwhile wait
+ * for that rescan of the new entries.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a tar archive file, open for writing.
+ *               It must stay open and only be appended to through the appender until it is closed.
+ * @param commit_window_us How long, in microseconds, the first append of a batch waits for others
+ *                         to join it before writing. Zero only batches appends that arrive while
+ *                         the previous batch is being written.
+ *
+ * @return the appender, or NULL in case of error (including a compressed archive,
+ *         or an archive that already has an appender).
+ */
+tar_appender_t *tar_appender_open(int tar_fd, unsigned int commit_window_us);
+
+/**
+ * Adds a file at the end of the archive, at the archive's root level, and returns once it is durable.
+ * The header is set like add_file() does. Safe to call from several threads at once.
+ *
+ * @param a An appender returned by tar_appender_open().
+ * @param filename The name of the file to add. If an entry already exists with the same name, the file is not written, and the function returns -1.
+ * @param src A source buffer containing the file content to add.
+ * @param len The length of the source buffer.
+ *
+ * @return 0 if the file was added and synced to disk,
+ *         -1 if the archive already contains an entry at the given path,
+ *         -2 if an error occurred (or the name is longer than the 100 bytes of a header's name field)
+ */
+int tar_append(tar_appender_t *a, char *filename, uint8_t *src, size_t len);
+
+/**
+ * Closes an appender. Appends still in progress must have returned.
+ *
+ * @param a An appender returned by tar_appender_open(), or NULL.
+ */
+void tar_appender_close(tar_appender_t *a);
+
+typedef int (*tar_find_cb)(const char *path, void *arg);
+
+/**
+ * Finds the entries whose path matches a pattern, in path order.
+ * The pattern is matched against whole paths, component by component:
+ *  - '*' matches any run of characters but '/', '?' any one character but '/',
+ *  - [abc], [a-z] match one character of a set, [!abc] or [^abc] one out of it,
+ *  - a component made of "**" alone matches any number of directories: "logs" then
+ *    "**" matches everything under logs/, "**" then "app.log" matches app.log at any depth,
+ *  - '\' makes the character after it match itself,
+ *  - a trailing '/' only matches directories.
+ * Directories are matched without their trailing slash, so "logs" matches "logs/".
+ * Each path is reported once, even if the archive holds several copies of it.
+ * The query runs on the index of the archive's entries the other queries share,
+ * built by the first of them and kept up to date as the archive grows.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar archive file.
+ * @param pattern The pattern to match.
+ * @param cb Called with the path of each match (as stored in the archive) and arg.
+ *           Returning non-zero stops the search.
+ * @param arg Passed to cb.
+ *
+ * @return the number of entries matched (and reported to cb),
+ *         -1 in case of error.
+ */
+int tar_find(int tar_fd, const char *pattern, tar_find_cb cb, void *arg);
+
+typedef struct tar_multi tar_multi_t;
+
+#define TAR_MULTI_LAST_WINS 1     /* the last archive of the set overrides the others */
+
+/**
+ * Opens a set of archives as a single namespace.
+ * A path is served by the first archive that holds it in the override order: fds[0]
+ * first, or fds[n - 1] first with TAR_MULTI_LAST_WINS. A symlink may point into
+ * another archive of the set. The index of each archive is built (or taken from the
+ * library's cache) in parallel, and kept until the view is closed. A lookup checks
+ * the archives' status at most once a millisecond: writes made through this library
+ * are seen at once, those of other processes within a millisecond.
+ *
+ * @param fds File descriptors pointing to the start of valid tar archive files.
+ *            They must stay open while the view is.
+ * @param n The number of archives.
+ * @param flags 0, or TAR_MULTI_LAST_WINS.
+ *
+ * @return the view, or NULL in case of error.
+ */
+tar_multi_t *tar_multi_open(const int *fds, size_t n, int flags);
+
+/**
+ * Checks whether an entry exists in any archive of a view.
+ *
+ * @param m A view returned by tar_multi_open().
+ * @param path A path to an entry.
+ *
+ * @return the position in fds, from 1, of the archive serving the entry,
+ *         zero if no archive holds an entry at the given path,
+ *         -1 in case of error.
+ */
+int tar_multi_exists(tar_multi_t *m, const char *path);
+
+/**
+ * Checks whether the entry serving a path in a view is a directory.
+ *
+ * @param m A view returned by tar_multi_open().
+ * @param path A path to an entry.
+ *
+ * @return zero if no archive holds an entry at the given path or the entry is not a directory,
+ *         any other value otherwise.
+ */
+int tar_multi_is_dir(tar_multi_t *m, const char *path);
+
+/**
+ * Checks whether the entry serving a path in a view is a file.
+ *
+ * @param m A view returned by tar_multi_open().
+ * @param path A path to an entry.
+ *
+ * @return zero if no archive holds an entry at the given path or the entry is not a file,
+ *         any other value otherwise.
+ */
+int tar_multi_is_file(tar_multi_t *m, const char *path);
+
+/**
+ * Checks whether the entry serving a path in a view is a symlink.
+ *
+ * @param m A view returned by tar_multi_open().
+ * @param path A path to an entry.
+ *
+ * @return zero if no archive holds an entry at the given path or the entry is not a symlink,
+ *         any other value otherwise.
+ */
+int tar_multi_is_symlink(tar_multi_t *m, const char *path);
+
+/**
+ * Lists the entries at a given path in a view, merged across its archives.
+ * The directory is the one serving the path; its entries are listed from every
+ * archive, each name once (the entry of the first archive holding it in the
+ * override order), in override order then archive order.
+ *
+ * @param m A view returned by tar_multi_open().
+ * @param path A path to a directory, NULL for the root. Symlinks are resolved.
+ * @param entries An array of char arrays of TAR_PATH_MAX bytes each; a longer entry path makes the call fail.
+ * @param no_entries An in-out argument.
+ *                   The caller set it to the number of entries in `entries`.
+ *                   The callee set it to the number of entries listed.
+ *
+ * @return zero if no directory serves the given path,
+ *         1 in case of success,
+ *         -1 in case of error.
+ */
+int tar_multi_list(tar_multi_t *m, const char *path, char **entries, size_t *no_entries);
+
+/**
+ * Reads the file serving a path in a view.
+ *
+ * @param m A view returned by tar_multi_open().
+ * @param path A path to a file. Symlinks are resolved.
+ * @param offset An offset in the file from which to start reading from.
+ * @param dest A destination buffer to read the given file into.
+ * @param len An in-out argument.
+ *            The caller set it to the size of dest.
+ *            The callee set it to the number of bytes written to dest.
+ *
+ * @return as read_file() does.
+ */
+ssize_t tar_multi_read_file(tar_multi_t *m, const char *path, size_t offset, uint8_t *dest, size_t *len);
+
+/**
+ * Closes a view. The archives' file descriptors are left open.
+ *
+ * @param m A view returned by tar_multi_open(), or NULL.
+ */
+void tar_multi_close(tar_multi_t *m);
+
+#define TAR_DIFF_ADDED 1          /* in the newer archive only */
+#define TAR_DIFF_REMOVED 2        /* in the older archive only */
+#define TAR_DIFF_CHANGED 3
+
+#define TAR_DIFF_CONTENT 1        /* compare the data of files instead of their mtime */
+
+typedef int (*tar_diff_cb)(const char *path, int change, void *arg);
+
+/**
+ * Compares two archives by path, in one pass over their indexes.
+ * An entry is changed when its type, mode, size or link target differ, or its
+ * mtime does (its data, with TAR_DIFF_CONTENT). Unlike the lookups of this library,
+ * the last copy of a path stands for it, as when tar extracts an archive grown
+ * with -r or -u.
+ *
+ * @param old_fd A file descriptor pointing to the start of the older archive.
+ * @param new_fd A file descriptor pointing to the start of the newer archive.
+ * @param cb Called, in path order, with the path of each difference, one of
+ *           TAR_DIFF_ADDED, TAR_DIFF_REMOVED or TAR_DIFF_CHANGED, and arg; may be NULL.
+ *           Returning non-zero stops the reports (the delta archive is still written).
+ * @param arg Passed to cb.
+ * @param flags 0, or TAR_DIFF_CONTENT.
+ * @param delta_fd -1, or a file descriptor on an empty file or a tar archive, open for
+ *                 writing, to which the added and changed entries of the newer archive
+ *                 are copied as they are stored (removals cannot be recorded in a tar archive).
+ *
+ * @return the number of differences,
+ *         -1 in case of error (including an archive with a corrupt header).
+ */
+int tar_diff(int old_fd, int new_fd, tar_diff_cb cb, void *arg, int flags, int delta_fd);
+
+#define TAR_CHECKSUM_MISMATCH 1   /* the data no longer has its recorded CRC */
+#define TAR_CHECKSUM_MISSING 2    /* recorded, but no longer in the archive at the same place */
+#define TAR_CHECKSUM_UNRECORDED 3 /* a file the sidecar does not cover */
+
+typedef int (*tar_checksum_cb)(const char *path, int status, void *arg);
+
+/**
+ * Computes the CRC32C of the data of every file in the archive and writes them
+ * to a sidecar file, to be checked later by tar_checksum_verify(). The files are
+ * checksummed in parallel, large ones included.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar file.
+ * @param sidecar_fd A file descriptor open for writing, whose content is replaced.
+ *
+ * @return the number of files checksummed,
+ *         -1 in case of error (including an archive with a corrupt header).
+ */
+int tar_checksum_write(int tar_fd, int sidecar_fd);
+
+/**
+ * Checks the data of the files in the archive against the CRC32C recorded by
+ * tar_checksum_write(). A file is matched to its line by the offset of its header
+ * and its size, so that a sidecar stays valid for the entries an append leaves in place.
+ *
+ * @param tar_fd A file descriptor pointing to the start of a valid tar file.
+ * @param sidecar_fd A file descriptor on a sidecar written by tar_checksum_write().
+ * @param cb Called with the path of each problem, one of TAR_CHECKSUM_MISMATCH,
+ *           TAR_CHECKSUM_MISSING or TAR_CHECKSUM_UNRECORDED, and arg; may be NULL.
+ *           The missing entries come first, in the order of the sidecar, then the
+ *           others in archive order. Returning non-zero stops the reports.
+ * @param arg Passed to cb.
+ *
+ * @return the number of problems (zero if the archive is intact),
+ *         -1 in case of error (including a malformed sidecar or an archive with a corrupt header).
+ */
+int tar_checksum_verify(int tar_fd, int sidecar_fd, tar_checksum_cb cb, void *arg);
+
+/* API functions, as counted by tar_stats_get(). */
+enum tar_op {
+    TAR_OP_CHECK_ARCHIVE,
+    TAR_OP_EXISTS,
+    TAR_OP_IS_DIR,
+    TAR_OP_IS_FILE,
+    TAR_OP_IS_SYMLINK,
+    TAR_OP_LIST,
+    TAR_OP_READ_FILE,
+    TAR_OP_ADD_FILE,
+    TAR_OP_RECOVER,
+    TAR_OP_APPEND,
+    TAR_OP_FIND,
+    TAR_OP_MULTI_OPEN,
+    TAR_OP_MULTI_EXISTS,
+    TAR_OP_MULTI_IS_DIR,
+    TAR_OP_MULTI_IS_FILE,
+    TAR_OP_MULTI_IS_SYMLINK,
+    TAR_OP_MULTI_LIST,
+    TAR_OP_MULTI_READ_FILE,
+    TAR_OP_DIFF,
+    TAR_OP_CHECKSUM_WRITE,
+    TAR_OP_CHECKSUM_VERIFY,
+    TAR_OP_COUNT
+};
+
+/* Latency histogram: bucket i counts the calls that took less than 2^i microseconds
+   (and at least 2^(i-1)), the last bucket everything slower. */
+#define TAR_LATENCY_BUCKETS 32
+
+typedef struct {
+    uint64_t calls;
+    uint64_t syscalls;            /* system calls issued: reads, io_uring_enter, fadvise, fstat, writes, syncs */
+    uint64_t bytes_read;          /* bytes read from the file (compressed bytes for a .tar.gz) */
+    uint64_t headers;             /* headers parsed */
+    uint64_t bytes_skipped;       /* entry data scanned over without reading it */
+    uint64_t symlink_hops;        /* symlinks followed */
+    uint64_t cache_hits;          /* reads answered from the library's buffers without a system call */
+    uint64_t latency_ns;          /* time spent in the calls, when latencies are recorded */
+    uint64_t latency[TAR_LATENCY_BUCKETS];
+} tar_op_stats_t;
+
+typedef struct {
+    tar_op_stats_t ops[TAR_OP_COUNT];
+} tar_stats_t;
+
+#define TAR_STATS_GLOBAL 0        /* every call made in the process */
+#define TAR_STATS_THREAD 1        /* the calls made by the calling thread */
+
+/**
+ * Copies the counters of the calls made so far, per API function.
+ * A call made from within another one (the exists() of an add_file()) is counted in the outer one.
+ * The calls made from a callback of tar_find(), tar_diff() or tar_checksum_verify() are counted on
+ * their own, and the time spent in the callbacks is not part of the latency of the call running them.
+ *
+ * @param scope TAR_STATS_GLOBAL or TAR_STATS_THREAD.
+ * @param out Where to copy the counters.
+ *
+ * @return 0 on success,
+ *         -1 if the scope is unknown.
+ */
+int tar_stats_get(int scope, tar_stats_t *out);
+
+/**
+ * Sets the counters of a scope back to zero.
+ *
+ * @param scope TAR_STATS_GLOBAL or TAR_STATS_THREAD.
+ */
+void tar_stats_reset(int scope);
+
+/**
+ * Turns the recording of call latencies on or off. It is off by default, since it
+ * costs two clock reads per call.
+ *
+ * @param enable Non-zero to record latencies, zero to stop.
+ */
+void tar_stats_latency(int enable);
+
+/**
+ * Returns the name of an API function, e.g. "exists" for TAR_OP_EXISTS, or NULL.
+ *
+ * @param op One of the TAR_OP_* values.
+ */
+const char *tar_op_name(int op);
+
 #endif
@@ -3,16 +3,36 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
 
 #include "lib_tar.h"
 
 #define MAX_ENTRIES 128
-#define PATHBUF 512
+#define PATHBUF TAR_PATH_MAX
+
+// over the 255 bytes of a ustar name and prefix, the Makefile stores dir1/test2.txt under it
+// in archive_long.tar (GNU 'L' header) and archive_pax.tar (PAX 'x' header)
+#define LONG_PATH "deep/" \
+    "a_rather_long_directory_name_for_the_long_name_tests/a_rather_long_directory_name_for_the_long_name_tests/" \
+    "a_rather_long_directory_name_for_the_long_name_tests/a_rather_long_directory_name_for_the_long_name_tests/" \
+    "a_rather_long_directory_name_for_the_long_name_tests/a_rather_long_directory_name_for_the_long_name_tests/" \
+    "test2.txt"
 
 /**
  * You are free to use this file to write tests for your implementation
  */
 
+static int failures;
+
+// les résultats vérifiés : un échec est affiché et fait échouer ./tests, donc make
+void expect(int ok, const char *what) {
+    if (!ok) {
+        printf("FAILED: %s\n", what);
+        failures++;
+    }
+}
+
 void debug_dump(const uint8_t *bytes, size_t len) {
     for (int i = 0; i < len;) {
         printf("%04x:  ", (int) i);
@@ -28,12 +48,111 @@ void debug_dump(const uint8_t *bytes, size_t len) {
     }
 }
 
+int print_match(const char *path, void *arg) {
+    printf("match: %s\n", path);
+    return 0;
+}
+
+int count_match(const char *path, void *arg) {
+    (*(int *)arg)++;
+    return 0;
+}
+
+struct exists_test {
+    int fd;
+    int found;
+};
+
+// un appel de l'API depuis un callback, compté à part de l'appel qui le fait
+int exists_match(const char *path, void *arg) {
+    struct exists_test *t = arg;
+    t->found += exists(t->fd, (char *)path) != 0;
+    return 0;
+}
+
+int print_change(const char *path, int change, void *arg) {
+    const char *changes[] = {"", "added", "removed", "changed"};
+    printf("%s: %s\n", changes[change], path);
+    return 0;
+}
+
+int print_problem(const char *path, int status, void *arg) {
+    const char *problems[] = {"", "mismatch", "missing", "unrecorded"};
+    printf("%s: %s\n", problems[status], path);
+    return 0;
+}
+
+#define SNAPSHOT_ENTRIES 32
+#define SNAPSHOT_SIZE 8192
+
+struct snapshot_test {
+    tar_appender_t *appender;
+    int started;        // appends entered, committed or not
+    int done;           // appends returned, hence committed
+    int seen;           // entries seen by the current reader
+    int bad;
+};
+
+// l'entrée numéro i : des octets qui dépendent de i, pour voir une entrée incomplète ou mélangée
+void snapshot_content(int i, uint8_t *content) {
+    for (int j = 0; j < SNAPSHOT_SIZE; ++j) content[j] = (uint8_t)('a' + (i + j) % 26);
+}
+
+void *snapshot_appender(void *arg) {
+    struct snapshot_test *t = arg;
+    uint8_t content[SNAPSHOT_SIZE];
+    char name[32];
+    for (int i = 0; i < SNAPSHOT_ENTRIES; ++i) {
+        snprintf(name, sizeof(name), "snap_%02d.txt", i);
+        snapshot_content(i, content);
+        __atomic_store_n(&t->started, i + 1, __ATOMIC_SEQ_CST);
+        if (tar_append(t->appender, name, content, sizeof(content)) != 0) t->bad++;
+        __atomic_store_n(&t->done, i + 1, __ATOMIC_SEQ_CST);
+    }
+    return NULL;
+}
+
+// les entrées vues doivent être snap_00.txt, snap_01.txt... sans trou
+int snapshot_match(const char *path, void *arg) {
+    struct snapshot_test *t = arg;
+    char name[32];
+    snprintf(name, sizeof(name), "snap_%02d.txt", t->seen++);
+    if (strcmp(path, name) != 0) t->bad++;
+    return 0;
+}
+
+#define APPEND_THREADS 8
+#define APPEND_PER_THREAD 16
+
+struct append_test {
+    tar_appender_t *appender;
+    int thread;
+    int failed;
+};
+
+// des appels concurrents, groupés par l'appender dans des lots qui partagent leurs fdatasync()
+void *append_worker(void *arg) {
+    struct append_test *t = arg;
+    uint8_t content[SNAPSHOT_SIZE];
+    char name[32];
+    for (int i = 0; i < APPEND_PER_THREAD; ++i) {
+        snprintf(name, sizeof(name), "t%d_%02d.txt", t->thread, i);
+        snapshot_content(t->thread * APPEND_PER_THREAD + i, content);
+        if (tar_append(t->appender, name, content, sizeof(content)) != 0) t->failed++;
+    }
+    return NULL;
+}
+
 int main(int argc, char **argv) {
     if (argc < 2) {
-        printf("Usage: %s tar_file\n", argv[0]);
+        printf("Usage: %s tar_file [uring]\n", argv[0]);
         return -1;
     }
 
+    if (argc > 2 && strcmp(argv[2], "uring") == 0) {
+        printf("tar_use_uring returned %d\n", tar_use_uring(1));
+    }
+
     int fd = open(argv[1] , O_RDWR);
     if (fd == -1) {
         perror("open(tar_file)");
@@ -173,6 +292,206 @@ int main(int argc, char **argv) {
     // problème : find_entry() récpération d'un path symlink via header_path() donne dir_symlink (sans le /)
 
 
+    // --- READ_FILE TESTS ----
+
+    printf("\n--- READ_FILE TESTS ---\n");
+
+    char *read_paths[] = {
+        "test1.txt",        // oui
+        "dir1/test2.txt",   // oui
+        "test_symlink.txt", // oui, résolu vers test1.txt
+        "dir1/",            // non (dossier) -> -1
+        "nonexistent.txt"   // non -> -1
+    };
+
+    uint8_t read_buf[PATHBUF];
+    for (size_t i = 0; i < sizeof(read_paths)/sizeof(read_paths[0]); ++i) {
+        size_t read_len = sizeof(read_buf);
+        ssize_t rret = read_file(fd, read_paths[i], 0, read_buf, &read_len);
+        printf("read_file(%s) returned %zd, len %zu: %.*s\n", read_paths[i], rret, read_len,
+               rret < 0 ? 0 : (int)read_len, read_buf);
+    }
+
+    size_t read_len = 4;
+    ssize_t rret = read_file(fd, "test1.txt", 2, read_buf, &read_len);
+    printf("read_file(test1.txt, offset 2, len 4) returned %zd, len %zu: %.*s\n", rret, read_len, (int)read_len, read_buf);
+
+    read_len = sizeof(read_buf);
+    rret = read_file(fd, "test1.txt", 1000, read_buf, &read_len);
+    printf("read_file(test1.txt, offset 1000) returned %zd\n", rret);
+
+
+    // --- BULK READ TESTS ----
+
+    printf("\n--- BULK READ TESTS ---\n");
+
+    // plus de 2 * 128 Kio : avec io_uring, lu par morceaux soumis ensemble ; doit donner les mêmes octets que pread()
+    size_t big_len = 600 * 1024 + 123;
+    uint8_t *big = malloc(big_len), *big_pread = malloc(big_len), *big_uring = malloc(big_len);
+    for (size_t i = 0; i < big_len; ++i) big[i] = (uint8_t)(i * 31 + i / 4096);
+    int big_fd = fileno(tmpfile());
+    if (ftruncate(big_fd, 1024) == -1) perror("ftruncate(big)");
+    printf("add_file(big.bin) returned %d\n", add_file(big_fd, "big.bin", big, big_len));
+
+    int uring_on = argc > 2 && strcmp(argv[2], "uring") == 0;
+    size_t offsets[] = {0, 1000};
+    for (size_t i = 0; i < sizeof(offsets)/sizeof(offsets[0]); ++i) {
+        size_t pread_len = big_len, uring_len = big_len;
+        tar_use_uring(0);
+        ssize_t pret = read_file(big_fd, "big.bin", offsets[i], big_pread, &pread_len);
+        int uret = tar_use_uring(1);
+        ssize_t rret_u = read_file(big_fd, "big.bin", offsets[i], big_uring, &uring_len);
+        int same = pread_len == big_len - offsets[i] && uring_len == pread_len &&
+                   memcmp(big_pread, big + offsets[i], pread_len) == 0 && memcmp(big_uring, big_pread, pread_len) == 0;
+        printf("read_file(big.bin, offset %zu) returned %zd with pread, %zd with uring (%s), same bytes %d\n",
+               offsets[i], pret, rret_u, uret == 0 ? "on" : "unavailable", same);
+        expect(pret == 0 && rret_u == 0 && same, "bulk read through io_uring");
+    }
+    // l'archive coupée au milieu des données : une lecture courte, les morceaux encore en vol sont attendus
+    if (ftruncate(big_fd, 512 + 300 * 1024) == -1) perror("ftruncate(big)");
+    size_t torn_len = big_len;
+    rret = read_file(big_fd, "big.bin", 0, big_uring, &torn_len);
+    printf("read_file(big.bin, truncated archive) returned %zd\n", rret);
+    expect(rret == -1, "bulk read of a truncated archive");
+    tar_use_uring(uring_on);
+    close(big_fd);
+    free(big);
+    free(big_pread);
+    free(big_uring);
+
+
+    // --- LONG NAME TESTS ----
+
+    printf("\n--- LONG NAME TESTS ---\n");
+
+    printf("exists(LONG_PATH) returned %d\n", exists(fd, LONG_PATH));
+    printf("is_file(LONG_PATH) returned %d\n", is_file(fd, LONG_PATH));
+
+    read_len = sizeof(read_buf);
+    rret = read_file(fd, LONG_PATH, 0, read_buf, &read_len);
+    printf("read_file(LONG_PATH) returned %zd, len %zu: %.*s\n", rret, read_len, rret < 0 ? 0 : (int)read_len, read_buf);
+
+
+    // --- FIND TESTS ----
+
+    printf("\n--- FIND TESTS ---\n");
+
+    char *patterns[] = {
+        "*.txt",            // test1.txt, test2.txt, test3.txt, test_symlink.txt
+        "dir1/*",           // dir1/test1.txt, dir1/test2.txt
+        "**",               // tout
+        "*/",               // dir1/
+        "dir1/test[!1].txt" // dir1/test2.txt
+    };
+    for (size_t i = 0; i < sizeof(patterns)/sizeof(patterns[0]); ++i) {
+        printf("tar_find(%s):\n", patterns[i]);
+        ret = tar_find(fd, patterns[i], print_match, NULL);
+        printf("tar_find returned %d\n", ret);
+    }
+
+
+    // --- MULTI TESTS ----
+
+    printf("\n--- MULTI TESTS ---\n");
+
+    // la même archive deux fois : chaque nom n'est listé qu'une fois
+    int shards[2] = {fd, open(argv[1], O_RDONLY)};
+    tar_multi_t *multi = tar_multi_open(shards, 2, TAR_MULTI_LAST_WINS);
+    printf("tar_multi_open returned %s\n", multi ? "a view" : "NULL");
+    printf("tar_multi_exists(test1.txt) returned %d\n", tar_multi_exists(multi, "test1.txt"));
+    printf("tar_multi_is_dir(dir1/) returned %d\n", tar_multi_is_dir(multi, "dir1/"));
+    printf("tar_multi_is_symlink(test_symlink.txt) returned %d\n", tar_multi_is_symlink(multi, "test_symlink.txt"));
+
+    size_t no_entries_m = MAX_ENTRIES;
+    ret = tar_multi_list(multi, NULL, entries_2, &no_entries_m);
+    printf("tar_multi_list returned %d\n", ret);
+    for (size_t i = 0; i < no_entries_m; ++i) {
+        printf("entry %zu: %s\n", i, entries_2[i]);
+    }
+
+    size_t len_m = sizeof(read_buf);
+    ssize_t ret_m = tar_multi_read_file(multi, "test_symlink.txt", 0, read_buf, &len_m);
+    printf("tar_multi_read_file(test_symlink.txt) returned %zd, len %zu\n", ret_m, len_m);
+    tar_multi_close(multi);
+    close(shards[1]);
+
+
+    // --- DIFF TESTS ----
+
+    printf("\n--- DIFF TESTS ---\n");
+
+    ret = tar_diff(fd, fd, print_change, NULL, TAR_DIFF_CONTENT, -1);
+    printf("tar_diff(archive, archive) returned %d\n", ret);
+
+    // depuis une archive vide (deux blocs nuls) tout est ajouté, et copié dans le delta
+    int empty_fd = fileno(tmpfile());
+    int delta_fd = fileno(tmpfile());
+    if (ftruncate(empty_fd, 1024) == -1) perror("ftruncate(empty)");
+    ret = tar_diff(empty_fd, fd, print_change, NULL, 0, delta_fd);
+    printf("tar_diff(empty, archive) returned %d\n", ret);
+    printf("check_archive(delta) returned %d\n", check_archive(delta_fd));
+    ret = tar_diff(delta_fd, fd, print_change, NULL, TAR_DIFF_CONTENT, -1);
+    printf("tar_diff(delta, archive) returned %d\n", ret);
+
+    // une archive grossie comme par tar -r : la seconde copie de dup.txt est celle qui compte
+    int dup_old_fd = fileno(tmpfile()), dup_new_fd = fileno(tmpfile()), dup_fd = fileno(tmpfile());
+    uint8_t old_copy[] = "old copy\n", new_copy[] = "new copy\n";
+    uint8_t dup_entry[1024];
+    if (ftruncate(dup_old_fd, 1024) == -1 || ftruncate(dup_new_fd, 1024) == -1) perror("ftruncate(dup)");
+    add_file(dup_old_fd, "dup.txt", old_copy, sizeof(old_copy) - 1);
+    add_file(dup_new_fd, "dup.txt", new_copy, sizeof(new_copy) - 1);
+    // l'en-tête et le bloc de données de l'ancienne copie, puis toute la nouvelle archive
+    if (pread(dup_old_fd, dup_entry, sizeof(dup_entry), 0) != sizeof(dup_entry) ||
+        pwrite(dup_fd, dup_entry, sizeof(dup_entry), 0) != sizeof(dup_entry)) perror("dup_entry");
+    for (off_t off = 0; pread(dup_new_fd, dup_entry, sizeof(dup_entry), off) == sizeof(dup_entry);
+         off += sizeof(dup_entry)) {
+        if (pwrite(dup_fd, dup_entry, sizeof(dup_entry), off + sizeof(dup_entry)) != sizeof(dup_entry)) perror("dup");
+    }
+    ret = tar_diff(dup_new_fd, dup_fd, print_change, NULL, TAR_DIFF_CONTENT, -1);
+    printf("tar_diff(new copy, both copies) returned %d\n", ret);
+    expect(ret == 0, "tar_diff compares the last copy of a path");
+    ret = tar_diff(dup_old_fd, dup_fd, print_change, NULL, TAR_DIFF_CONTENT, -1);
+    printf("tar_diff(old copy, both copies) returned %d\n", ret);
+    expect(ret == 1, "tar_diff sees the old copy replaced");
+    close(dup_old_fd);
+    close(dup_new_fd);
+    close(dup_fd);
+
+
+    // --- CHECKSUM TESTS ----
+
+    printf("\n--- CHECKSUM TESTS ---\n");
+
+    int sidecar_fd = fileno(tmpfile());
+    ret = tar_checksum_write(fd, sidecar_fd);
+    printf("tar_checksum_write returned %d\n", ret);
+    ret = tar_checksum_verify(fd, sidecar_fd, print_problem, NULL);
+    printf("tar_checksum_verify returned %d\n", ret);
+
+    // deux fichiers dans une archive neuve, puis un octet de données modifié et un fichier en plus
+    int crc_fd = fileno(tmpfile());
+    int crc_sidecar_fd = fileno(tmpfile());
+    uint8_t first_content[] = "first file\n", second_content[] = "second file\n";
+    if (ftruncate(crc_fd, 1024) == -1) perror("ftruncate(crc)");
+    add_file(crc_fd, "first.txt", first_content, sizeof(first_content) - 1);
+    add_file(crc_fd, "second.txt", second_content, sizeof(second_content) - 1);
+    ret = tar_checksum_write(crc_fd, crc_sidecar_fd);
+    printf("tar_checksum_write(new archive) returned %d\n", ret);
+
+    uint8_t flipped = 'F';
+    if (pwrite(crc_fd, &flipped, 1, 512) != 1) perror("pwrite(crc)");   // le premier octet de first.txt
+    add_file(crc_fd, "third.txt", first_content, sizeof(first_content) - 1);
+    ret = tar_checksum_verify(crc_fd, crc_sidecar_fd, print_problem, NULL);
+    printf("tar_checksum_verify(modified archive) returned %d\n", ret);
+
+    // la même archive sans second.txt : sa ligne n'a plus d'entrée
+    int short_fd = fileno(tmpfile());
+    if (ftruncate(short_fd, 1024) == -1) perror("ftruncate(short)");
+    add_file(short_fd, "first.txt", first_content, sizeof(first_content) - 1);
+    ret = tar_checksum_verify(short_fd, crc_sidecar_fd, print_problem, NULL);
+    printf("tar_checksum_verify(shorter archive) returned %d\n", ret);
+
+
     // --- ADD_FILE TESTS ----
 
     printf("\n--- ADD_FILE TESTS ---\n");
@@ -200,11 +519,217 @@ int main(int argc, char **argv) {
         printf("entry %zu: %s\n", i, entries_2[i]);
     }
 
-    
+
+
+    // --- APPENDER TESTS ----
+
+    printf("\n--- APPENDER TESTS ---\n");
+
+    ret = tar_recover(fd);
+    printf("tar_recover returned %d\n", ret);
+
+    // une entrée dont les données sont coupées par la fin du fichier
+    uint8_t torn_content[1000];
+    memset(torn_content, 't', sizeof(torn_content));
+    int torn_fd = fileno(tmpfile());
+    if (ftruncate(torn_fd, 1024) == -1) perror("ftruncate(torn)");
+    add_file(torn_fd, "kept.txt", file_content, file_length);
+    add_file(torn_fd, "torn.txt", torn_content, sizeof(torn_content));
+    if (ftruncate(torn_fd, 3 * 512 + 100) == -1) perror("ftruncate(torn)");   // l'en-tête de torn.txt et 100 octets
+    ret = tar_recover(torn_fd);
+    printf("tar_recover(truncated data) returned %d\n", ret);
+    int checked = check_archive(torn_fd), found = exists(torn_fd, "torn.txt");
+    printf("check_archive returned %d, exists(torn.txt) returned %d\n", checked, found);
+    expect(ret == 1 && checked == 1 && !found, "tar_recover of torn data");
+
+    // des octets non nuls après les deux blocs nuls de fin
+    int junk_fd = fileno(tmpfile());
+    if (ftruncate(junk_fd, 1024) == -1) perror("ftruncate(junk)");
+    add_file(junk_fd, "kept.txt", file_content, file_length);
+    if (pwrite(junk_fd, "junk", 4, 4 * 512 + 3) != 4) perror("pwrite(junk)");
+    ret = tar_recover(junk_fd);
+    printf("tar_recover(junk after the end) returned %d\n", ret);
+    checked = check_archive(junk_fd);
+    found = exists(junk_fd, "kept.txt");
+    printf("check_archive returned %d, exists(kept.txt) returned %d\n", checked, found);
+    expect(ret == 1 && checked == 1 && found, "tar_recover of junk after the end");
+
+    tar_appender_t *appender = tar_appender_open(fd, 0);
+    printf("tar_appender_open returned %s\n", appender ? "an appender" : "NULL");
+    if (appender) {
+        ret = tar_append(appender, "appended_file.txt", file_content, file_length);
+        printf("tar_append returned %d\n", ret);
+
+        // should give back error (file already existing)
+        ret = tar_append(appender, "new_test_file.txt", file_content, file_length);
+        printf("tar_append returned %d\n", ret);
+
+        // deux noms de plus de 100 octets qui ne diffèrent qu'après : refusés, pas tronqués
+        char long_name[128];
+        memset(long_name, 'n', 100);
+        strcpy(long_name + 100, "_1.txt");
+        ret = tar_append(appender, long_name, file_content, file_length);
+        int added = add_file(fd, long_name, file_content, file_length);
+        printf("tar_append(long name) returned %d, add_file(long name) returned %d\n", ret, added);
+        long_name[100] = '\0';
+        found = exists(fd, long_name);
+        printf("exists(the name cut to 100 bytes) returned %d\n", found);
+        expect(ret == -2 && added == -2 && !found, "names longer than 100 bytes");
+
+        tar_appender_close(appender);
+
+        no_entries_2 = MAX_ENTRIES;
+        ret = list(fd, NULL, entries_2, &no_entries_2);
+        printf("list after tar_append returned %d\n", ret);
+        for (size_t i = 0; i < no_entries_2; ++i) {
+            printf("entry %zu: %s\n", i, entries_2[i]);
+        }
+    }
+
+    // un lecteur prend son instantané avant des commits et lit après : il ne voit que des entrées
+    // validées avant sa fin, au moins celles validées avant son début, et chacune entière
+    int snap_fd = fileno(tmpfile());
+    if (ftruncate(snap_fd, 1024) == -1) perror("ftruncate(snap)");
+    struct snapshot_test snap = {tar_appender_open(snap_fd, 0), 0, 0, 0, 0};
+    pthread_t snap_thread;
+    uint8_t snap_buf[SNAPSHOT_SIZE], snap_expected[SNAPSHOT_SIZE];
+    int passes = 0;
+    pthread_create(&snap_thread, NULL, snapshot_appender, &snap);
+    while (__atomic_load_n(&snap.done, __ATOMIC_SEQ_CST) < SNAPSHOT_ENTRIES || passes == 0) {
+        int before = __atomic_load_n(&snap.done, __ATOMIC_SEQ_CST);
+        snap.seen = 0;
+        if (tar_find(snap_fd, "snap_*", snapshot_match, &snap) < 0) snap.bad++;
+        for (int i = 0; i < snap.seen; ++i) {
+            char name[32];
+            size_t len = sizeof(snap_buf);
+            snprintf(name, sizeof(name), "snap_%02d.txt", i);
+            snapshot_content(i, snap_expected);
+            if (read_file(snap_fd, name, 0, snap_buf, &len) != 0 || len != SNAPSHOT_SIZE
+                || memcmp(snap_buf, snap_expected, SNAPSHOT_SIZE) != 0) snap.bad++;
+        }
+        if (snap.seen < before || snap.seen > __atomic_load_n(&snap.started, __ATOMIC_SEQ_CST)) snap.bad++;
+        if (check_archive(snap_fd) < 0) snap.bad++;
+        passes++;
+    }
+    pthread_join(snap_thread, NULL);
+    tar_appender_close(snap.appender);
+    ret = exists(snap_fd, "snap_31.txt");
+    printf("readers during tar_append saw only whole committed entries %d, entries at the end %d\n", snap.bad == 0, ret);
+    expect(snap.bad == 0 && ret, "snapshots during tar_append");
+    close(snap_fd);
+
+    // plusieurs threads sur le même appender : toutes les entrées sont là, entières
+    int group_fd = fileno(tmpfile());
+    if (ftruncate(group_fd, 1024) == -1) perror("ftruncate(group)");
+    tar_appender_t *group = tar_appender_open(group_fd, 200);
+    struct append_test workers[APPEND_THREADS];
+    pthread_t worker_threads[APPEND_THREADS];
+    for (int t = 0; t < APPEND_THREADS; ++t) {
+        workers[t] = (struct append_test){group, t, 0};
+        pthread_create(&worker_threads[t], NULL, append_worker, &workers[t]);
+    }
+    int failed = 0;
+    for (int t = 0; t < APPEND_THREADS; ++t) {
+        pthread_join(worker_threads[t], NULL);
+        failed += workers[t].failed;
+    }
+    tar_appender_close(group);
+
+    int intact = 0;
+    for (int t = 0; t < APPEND_THREADS; ++t) {
+        for (int i = 0; i < APPEND_PER_THREAD; ++i) {
+            char name[32];
+            size_t len = sizeof(snap_buf);
+            snprintf(name, sizeof(name), "t%d_%02d.txt", t, i);
+            snapshot_content(t * APPEND_PER_THREAD + i, snap_expected);
+            intact += read_file(group_fd, name, 0, snap_buf, &len) == 0 && len == SNAPSHOT_SIZE
+                      && memcmp(snap_buf, snap_expected, SNAPSHOT_SIZE) == 0;
+        }
+    }
+    printf("%d threads appended %d entries, failed %d\n", APPEND_THREADS, APPEND_THREADS * APPEND_PER_THREAD, failed);
+    int matched = 0, recovered = tar_recover(group_fd);
+    checked = check_archive(group_fd);
+    ret = tar_find(group_fd, "t*", count_match, &matched);
+    printf("tar_recover returned %d, check_archive returned %d, tar_find(t*) returned %d, intact entries %d\n",
+           recovered, checked, ret, intact);
+    int group_total = APPEND_THREADS * APPEND_PER_THREAD;
+    expect(failed == 0 && recovered == 0 && checked == group_total && ret == group_total && intact == group_total,
+           "appends from several threads");
+    close(group_fd);
+
+
+    // --- STATS TESTS ----
+
+    printf("\n--- STATS TESTS ---\n");
+
+    tar_stats_reset(TAR_STATS_THREAD);
+    tar_stats_latency(1);
+    ret = exists(fd, "dir1/test2.txt");
+    printf("exists returned %d\n", ret);
+    size_t stats_len = sizeof(read_buf);
+    rret = read_file(fd, "test_symlink.txt", 0, read_buf, &stats_len);
+    printf("read_file returned %zd\n", rret);
+    tar_stats_latency(0);
+
+    tar_stats_t stats;
+    ret = tar_stats_get(TAR_STATS_THREAD, &stats);
+    printf("tar_stats_get returned %d\n", ret);
+    for (int op = 0; op < TAR_OP_COUNT; ++op) {
+        const tar_op_stats_t *o = &stats.ops[op];
+        if (o->calls == 0) continue;
+        uint64_t timed = 0;
+        for (int b = 0; b < TAR_LATENCY_BUCKETS; ++b) timed += o->latency[b];
+        printf("%s: calls %lu, headers %lu, symlink hops %lu, syscalls > 0: %d, timed calls %lu\n",
+               tar_op_name(op), (unsigned long)o->calls, (unsigned long)o->headers,
+               (unsigned long)o->symlink_hops, o->syscalls > 0, (unsigned long)timed);
+    }
+
+    // une archive neuve d'une entrée et une suite d'appels connue : les compteurs en découlent
+    int stats_fd = fileno(tmpfile());
+    if (ftruncate(stats_fd, 1024) == -1) perror("ftruncate(stats)");
+    add_file(stats_fd, "a.txt", file_content, file_length);
+    exists(stats_fd, "a.txt");   // construit l'index avant de compter
+
+    tar_stats_reset(TAR_STATS_THREAD);
+    tar_stats_latency(1);
+    exists(stats_fd, "a.txt");
+    exists(stats_fd, "b.txt");
+    stats_len = sizeof(read_buf);
+    read_file(stats_fd, "a.txt", 0, read_buf, &stats_len);
+    struct exists_test from_cb = {stats_fd, 0};
+    tar_find(stats_fd, "*", exists_match, &from_cb);
+    check_archive(stats_fd);
+    tar_stats_latency(0);
+    tar_stats_get(TAR_STATS_THREAD, &stats);
+
+    // chaque appel lit les 2 octets du magic gzip ; check_archive() lit l'en-tête et les deux blocs nuls
+    struct { int op; uint64_t calls, bytes_read, headers; } expected[] = {
+        {TAR_OP_EXISTS, 3, 3 * 2, 0},   // dont celui du callback de tar_find()
+        {TAR_OP_READ_FILE, 1, 2 + file_length, 0},
+        {TAR_OP_FIND, 1, 2, 0},
+        {TAR_OP_CHECK_ARCHIVE, 1, 2 + 3 * 512, 1},
+    };
+    int as_expected = 1;
+    uint64_t total_calls = 0;
+    for (int op = 0; op < TAR_OP_COUNT; ++op) total_calls += stats.ops[op].calls;
+    for (size_t i = 0; i < sizeof(expected)/sizeof(expected[0]); ++i) {
+        const tar_op_stats_t *o = &stats.ops[expected[i].op];
+        uint64_t timed = 0;
+        for (int b = 0; b < TAR_LATENCY_BUCKETS; ++b) timed += o->latency[b];
+        printf("%s: calls %lu, bytes read %lu, headers %lu, timed calls %lu\n", tar_op_name(expected[i].op),
+               (unsigned long)o->calls, (unsigned long)o->bytes_read, (unsigned long)o->headers, (unsigned long)timed);
+        as_expected &= o->calls == expected[i].calls && o->bytes_read == expected[i].bytes_read
+                       && o->headers == expected[i].headers && timed == o->calls;
+        total_calls -= o->calls;
+    }
+    printf("callback found %d, other calls %lu\n", from_cb.found, (unsigned long)total_calls);
+    expect(as_expected && total_calls == 0 && from_cb.found == 1, "stats counters");
+    close(stats_fd);
+
 
     close(fd);
 
 
 
-    return 0;
+    return failures ? 1 : 0;
 }
\ No newline at end of file